@@ -0,0 +1,344 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include "mesh.h"
+
+using glm::vec3;
+
+// Bounding volume hierarchy built with binned SAH and stored flat: nodes are laid out depth first so a node's
+// left child is the next node, and leaves point at a run of primitive indices. Primitives are the faces of a
+// Mesh, or the instances of a scene for the top level of instanced geometry. Both arrays are SharedArrays so a
+// BVH saved in a scene file or cache is used straight from the mapping.
+//
+// A mesh BVH belongs to the geometry it was built from, geometry_hash records which (see GeometryHash).
+//
+// Primitives that move without being added or removed, like animated spheres, keep their tree and have the
+// node boxes refitted bottom up. Refitting loosens the boxes as things move away from where they were when
+// the tree was built, so the SAH cost is compared against the cost at build time and the tree is rebuilt
+// once it has degraded by more than BVH_REFIT_LIMIT.
+
+const int BVH_MAX_DEPTH = 64;
+const int BVH_LEAF_SIZE = 4;
+const int BVH_BINS = 16;
+// Relative cost of testing a face against visiting a node, for the SAH
+const float BVH_FACE_COST = 1.0f;
+const float BVH_NODE_COST = 1.0f;
+// Subtrees with at least this many primitives are built as separate tasks
+const size_t BVH_TASK_FACES = 16384;
+// and subtrees with at least this many nodes refitted as separate tasks
+const size_t BVH_TASK_NODES = 8192;
+// Refitted trees are rebuilt once their SAH cost is this many times the cost they were built with
+const float BVH_REFIT_LIMIT = 1.5f;
+
+struct BVHNode {
+  float low[3];
+  uint32_t first;   // leaf: first entry in BVH::primitives, inner: index of the right child
+  float high[3];
+  uint32_t count;   // leaf: number of primitives, 0 for inner nodes
+};
+
+// Describes a stored BVH, kept alongside its arrays
+struct BVHInfo {
+  uint64_t geometry_hash;
+  uint64_t primitive_count;
+};
+
+// Mixes bytes into hash a whole word at a time, which is fast enough to run on every launch over meshes in the
+// millions of faces
+uint64_t HashWords(uint64_t hash, const void* data, size_t bytes) {
+  const uint8_t* p = (const uint8_t*)data;
+  for(; bytes >= 8; p += 8, bytes -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 29;
+  }
+  for(; bytes > 0; p++, bytes--) hash = (hash ^ *p) * 0x100000001B3ull;
+  return hash;
+}
+
+// Hash of the positions and face indices, materials do not change the hierarchy
+uint64_t GeometryHash(const Mesh& mesh) {
+  uint64_t hash = 0xCBF29CE484222325ull ^ mesh.positions.size() ^ (mesh.indices.size() << 32);
+  hash = HashWords(hash, mesh.positions.data(), mesh.positions.size() * sizeof(vec3));
+  hash = HashWords(hash, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+  return hash;
+}
+
+class BVH {
+public:
+  SharedArray<BVHNode> nodes;
+  SharedArray<uint32_t> primitives;
+  BVHInfo info;
+  float built_cost;   // cost() after the last build, 0 if not known
+  int leaf_size;      // most primitives the builder leaves in a leaf while splitting still pays
+
+  BVH() : built_cost(0), leaf_size(BVH_LEAF_SIZE) {
+    info.geometry_hash = 0;
+    info.primitive_count = 0;
+  }
+
+  bool empty() const {
+    return nodes.empty();
+  }
+
+  // Usable for mesh, without rehashing it
+  bool covers(const Mesh& mesh) const {
+    return !empty() && info.primitive_count == mesh.faceCount();
+  }
+
+  void build(const Mesh& mesh) {
+    size_t count = mesh.faceCount();
+    std::vector<vec3> lows(count), highs(count);
+    #pragma omp parallel for
+    for(size_t i = 0; i < count; i++) {
+      const vec3& a = mesh.positions[mesh.indices[i * 3]];
+      const vec3& b = mesh.positions[mesh.indices[(i * 3) + 1]];
+      const vec3& c = mesh.positions[mesh.indices[(i * 3) + 2]];
+      lows[i] = glm::min(a, glm::min(b, c));
+      highs[i] = glm::max(a, glm::max(b, c));
+    }
+    build(lows, highs);
+    info.geometry_hash = GeometryHash(mesh);
+  }
+
+  // Over any primitives given by their bounding boxes, takes the contents of both vectors. geometry_hash is 0.
+  void build(std::vector<vec3>& lows, std::vector<vec3>& highs) {
+    size_t count = lows.size();
+    info.geometry_hash = 0;
+    info.primitive_count = count;
+    nodes = SharedArray<BVHNode>();
+    primitives = SharedArray<uint32_t>();
+    built_cost = 0;
+    if(count == 0) return;
+
+    Builder builder;
+    builder.leaf_size = leaf_size;
+    builder.lows.swap(lows);
+    builder.highs.swap(highs);
+    builder.centroids.resize(count);
+    primitives.resize(count);
+    uint32_t* order = primitives.data();
+    #pragma omp parallel for
+    for(size_t i = 0; i < count; i++) {
+      builder.centroids[i] = (builder.lows[i] + builder.highs[i]) * 0.5f;
+      order[i] = (uint32_t)i;
+    }
+
+    builder.order = order;
+    std::vector<BVHNode> built;
+    built.reserve(2 * ((count / leaf_size) + 1));
+    #pragma omp parallel
+    #pragma omp single
+    builder.split(built, 0, count, 0);
+
+    nodes.resize(built.size());
+    std::copy(built.begin(), built.end(), nodes.data());
+    built_cost = cost();
+  }
+
+  // Moves the boxes to the primitives' new bounds keeping the tree, takes the contents of both vectors like
+  // build. Builds a new tree instead if the primitive count changed or the refitted tree costs more than
+  // BVH_REFIT_LIMIT times what it did when built. True if the tree was refitted.
+  bool refit(std::vector<vec3>& lows, std::vector<vec3>& highs) {
+    if(empty() || lows.size() != info.primitive_count) {
+      build(lows, highs);
+      return false;
+    }
+    //A tree that came from a file has no build cost yet, it was built for the boxes it has now
+    if(built_cost <= 0) built_cost = cost();
+
+    BVHNode* tree = nodes.data();
+    #pragma omp parallel
+    #pragma omp single
+    RefitNode(tree, primitives.data(), 0, lows.data(), highs.data());
+    info.geometry_hash = 0;
+
+    if(cost() > built_cost * BVH_REFIT_LIMIT) {
+      build(lows, highs);
+      return false;
+    }
+    return true;
+  }
+
+  // SAH cost of the tree with its boxes as they are: expected node visits and primitive tests for a ray
+  // through the root box
+  float cost() const {
+    if(empty()) return 0;
+    float root = NodeArea(nodes[0]);
+    if(root <= 0) return 0;
+    const BVHNode* tree = nodes.data();
+    long count = (long)nodes.size();
+    float total = 0;
+    #pragma omp parallel for reduction(+:total)
+    for(long i = 0; i < count; i++) {
+      const BVHNode& node = tree[i];
+      total += NodeArea(node) * (node.count > 0 ? BVH_FACE_COST * node.count : BVH_NODE_COST);
+    }
+    return total / root;
+  }
+
+private:
+  static float NodeArea(const BVHNode& node) {
+    vec3 e = vec3(node.high[0] - node.low[0], node.high[1] - node.low[1], node.high[2] - node.low[2]);
+    if(e.x < 0) return 0;
+    return 2 * ((e.x * e.y) + (e.y * e.z) + (e.z * e.x));
+  }
+
+  //Children are refitted before their parent, a left subtree is the nodes between its parent and the right child
+  static void RefitNode(BVHNode* tree, const uint32_t* order, uint32_t index, const vec3* lows, const vec3* highs) {
+    BVHNode& node = tree[index];
+    Bounds bounds;
+    if(node.count > 0) {
+      for(uint32_t i = node.first; i < node.first + node.count; i++) bounds.grow(lows[order[i]], highs[order[i]]);
+    } else {
+      uint32_t left = index + 1, right = node.first;
+      if(right - left >= BVH_TASK_NODES) {
+        #pragma omp task
+        RefitNode(tree, order, right, lows, highs);
+        RefitNode(tree, order, left, lows, highs);
+        #pragma omp taskwait
+      } else {
+        RefitNode(tree, order, left, lows, highs);
+        RefitNode(tree, order, right, lows, highs);
+      }
+      const BVHNode& a = tree[left];
+      const BVHNode& b = tree[right];
+      bounds.grow(vec3(a.low[0], a.low[1], a.low[2]), vec3(a.high[0], a.high[1], a.high[2]));
+      bounds.grow(vec3(b.low[0], b.low[1], b.low[2]), vec3(b.high[0], b.high[1], b.high[2]));
+    }
+    memcpy(node.low, &bounds.low[0], sizeof(float) * 3);
+    memcpy(node.high, &bounds.high[0], sizeof(float) * 3);
+  }
+
+  struct Bounds {
+    vec3 low, high;
+
+    Bounds() : low(1e30f), high(-1e30f) {}
+
+    void grow(const vec3& l, const vec3& h) {
+      low = glm::min(low, l);
+      high = glm::max(high, h);
+    }
+
+    float area() const {
+      vec3 e = high - low;
+      if(e.x < 0) return 0;
+      return 2 * ((e.x * e.y) + (e.y * e.z) + (e.z * e.x));
+    }
+  };
+
+  struct Builder {
+    std::vector<vec3> lows, highs, centroids;
+    uint32_t* order;
+    int leaf_size;
+
+    //Builds the subtree for order[first, first + count) at the end of nodes and returns its index there.
+    //Large right halves go to another task, which builds into its own vector that is appended afterwards.
+    uint32_t split(std::vector<BVHNode>& nodes, size_t first, size_t count, int depth) {
+      uint32_t index = (uint32_t)nodes.size();
+      nodes.push_back(BVHNode());
+
+      Bounds bounds, centroid_bounds;
+      for(size_t i = first; i < first + count; i++) {
+        bounds.grow(lows[order[i]], highs[order[i]]);
+        centroid_bounds.grow(centroids[order[i]], centroids[order[i]]);
+      }
+      memcpy(nodes[index].low, &bounds.low[0], sizeof(float) * 3);
+      memcpy(nodes[index].high, &bounds.high[0], sizeof(float) * 3);
+
+      size_t middle = count <= (size_t)leaf_size || depth >= BVH_MAX_DEPTH - 1 ? 0 : partition(first, count, bounds, centroid_bounds);
+      if(middle == 0) {
+        nodes[index].first = (uint32_t)first;
+        nodes[index].count = (uint32_t)count;
+        return index;
+      }
+
+      size_t right_count = first + count - middle;
+      uint32_t right;
+      if(right_count >= BVH_TASK_FACES) {
+        std::vector<BVHNode> right_nodes;
+        #pragma omp task shared(right_nodes)
+        split(right_nodes, middle, right_count, depth + 1);
+        split(nodes, first, middle - first, depth + 1);
+        #pragma omp taskwait
+
+        right = (uint32_t)nodes.size();
+        for(size_t i = 0; i < right_nodes.size(); i++) {
+          if(right_nodes[i].count == 0) right_nodes[i].first += right;
+        }
+        nodes.insert(nodes.end(), right_nodes.begin(), right_nodes.end());
+      } else {
+        split(nodes, first, middle - first, depth + 1);
+        right = split(nodes, middle, right_count, depth + 1);
+      }
+      nodes[index].first = right;
+      nodes[index].count = 0;
+      return index;
+    }
+
+    //Best binned SAH split, returns where the right half starts or 0 when a leaf is cheaper
+    size_t partition(size_t first, size_t count, const Bounds& bounds, const Bounds& centroid_bounds) {
+      float best_cost = BVH_FACE_COST * count;
+      int best_axis = -1, best_bin = 0;
+      vec3 extent = centroid_bounds.high - centroid_bounds.low;
+
+      for(int axis = 0; axis < 3; axis++) {
+        if(extent[axis] <= 0) continue;
+        Bounds bins[BVH_BINS];
+        size_t counts[BVH_BINS] = {};
+        float scale = BVH_BINS / extent[axis];
+        for(size_t i = first; i < first + count; i++) {
+          uint32_t face = order[i];
+          int bin = std::min(BVH_BINS - 1, (int)((centroids[face][axis] - centroid_bounds.low[axis]) * scale));
+          bins[bin].grow(lows[face], highs[face]);
+          counts[bin]++;
+        }
+
+        //Sweep from the right to get the cost of every split plane in one pass each way
+        float right_area[BVH_BINS];
+        size_t right_count[BVH_BINS];
+        Bounds right;
+        size_t right_total = 0;
+        for(int b = BVH_BINS - 1; b > 0; b--) {
+          right.grow(bins[b].low, bins[b].high);
+          right_total += counts[b];
+          right_area[b] = right.area();
+          right_count[b] = right_total;
+        }
+        Bounds left;
+        size_t left_total = 0;
+        for(int b = 1; b < BVH_BINS; b++) {
+          left.grow(bins[b - 1].low, bins[b - 1].high);
+          left_total += counts[b - 1];
+          if(left_total == 0 || right_count[b] == 0) continue;
+          float cost = BVH_NODE_COST + (BVH_FACE_COST * ((left.area() * left_total) + (right_area[b] * right_count[b])) / bounds.area());
+          if(cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_bin = b;
+          }
+        }
+      }
+
+      if(best_axis < 0) {
+        //Faces too big to leave in one leaf but all centred on one spot, halve them as they are
+        return count > (size_t)(leaf_size * 4) ? first + (count / 2) : 0;
+      }
+
+      float scale = BVH_BINS / extent[best_axis];
+      float low = centroid_bounds.low[best_axis];
+      uint32_t* middle = std::partition(order + first, order + first + count, [&](uint32_t face) {
+        return std::min(BVH_BINS - 1, (int)((centroids[face][best_axis] - low) * scale)) < best_bin;
+      });
+      return middle - order;
+    }
+  };
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "framebuffer.h"
+#include "settings.h"
+
+// Periodic snapshots of an offline render so a killed process can pick up where it stopped.
+//
+// Rows are the unit of progress: once a row is marked done its pixels never change again, so the
+// checkpoint thread can read them while the renderer carries on, no copy or lock needed. A snapshot
+// holds the photon map, a done flag per row and the accumulated estimate (sums and sample counts) of
+// every done row. The samplers are indexed by pixel and sample number, so the sampler type plus the
+// per pixel sample counts are the whole random state; unfinished rows simply start again.
+//
+// The header also identifies the scene, camera and render settings the estimate belongs to, resuming with
+// anything else would average two different images.
+//
+// File layout: CheckpointHeader, photon_count x 7 floats (energy rgb, position xyzw), height row flags,
+// then width x height PixelStats with unfinished rows zeroed.
+//
+// Needs Photon and Scene from geometry.h, which has no include guard, so include this after TestModelH.h.
+const uint32_t CHECKPOINT_VERSION = 3;
+
+// What a checkpoint was rendered from
+struct CheckpointIdentity {
+  uint64_t scene_hash;    // geometry, materials, spheres and lights, see SceneHash
+  uint64_t camera_hash;   // see CameraHash
+  RenderSettings settings;
+};
+
+uint64_t MeshHash(uint64_t hash, const Mesh& mesh) {
+  hash = HashWords(hash ^ GeometryHash(mesh), mesh.materials.data(), mesh.materials.size() * sizeof(uint32_t));
+  return hash;
+}
+
+// Everything about the scene that changes the image apart from the camera. The classes hashed byte for byte
+// are all 4 byte members, so they have no padding.
+uint64_t SceneHash(const Scene& scene) {
+  uint64_t hash = MeshHash(0xCBF29CE484222325ull, scene.scene_mesh);
+  hash = HashWords(hash, scene.scene_materials.data(), scene.scene_materials.size() * sizeof(ShaderProperties));
+  for(size_t i = 0; i < scene.scene_prototypes.size(); i++) hash = MeshHash(hash, scene.scene_prototypes[i].mesh);
+  hash = HashWords(hash, scene.scene_instances.data(), scene.scene_instances.size() * sizeof(Instance));
+  hash = HashWords(hash, scene.scene_triangles.data(), scene.scene_triangles.size() * sizeof(Triangle));
+  hash = HashWords(hash, scene.scene_spheres.data(), scene.scene_spheres.size() * sizeof(Sphere));
+  hash = HashWords(hash, scene.scene_lights.data(), scene.scene_lights.size() * sizeof(PointLight));
+  return hash;
+}
+
+uint64_t CameraHash(const vec4& position, const mat4& rotation) {
+  uint64_t hash = HashWords(0xCBF29CE484222325ull, &position[0], 4 * sizeof(float));
+  for(int column = 0; column < 4; column++) hash = HashWords(hash, &rotation[column][0], 4 * sizeof(float));
+  return hash;
+}
+
+struct CheckpointHeader {
+  char magic[4];      // "RTCK"
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t max_samples;
+  uint32_t sampler;
+  uint64_t photon_count;
+  CheckpointIdentity identity;
+};
+
+CheckpointHeader MakeCheckpointHeader(int width, int height, int max_samples, int sampler, size_t photon_count,
+                                      const CheckpointIdentity& identity) {
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RTCK", 4);
+  header.version = CHECKPOINT_VERSION;
+  header.width = width;
+  header.height = height;
+  header.max_samples = max_samples;
+  header.sampler = sampler;
+  header.photon_count = photon_count;
+  header.identity = identity;
+  return header;
+}
+
+class Checkpointer {
+public:
+  Checkpointer(const std::string& path, const Framebuffer& framebuffer, const std::vector<Photon>& photons,
+               int max_samples, int sampler, const CheckpointIdentity& identity)
+    : path(path), framebuffer(framebuffer), photons(photons), max_samples(max_samples), sampler(sampler),
+      identity(identity), rows(new std::atomic<uint8_t>[framebuffer.height]), stopping(false), failed(false)
+  {
+    for(int y = 0; y < framebuffer.height; y++) rows[y].store(0, std::memory_order_relaxed);
+  }
+
+  ~Checkpointer() {
+    stop();
+    delete[] rows;
+  }
+
+  // Call once the row's pixels are final, from any thread
+  void markRow(int y) {
+    rows[y].store(1, std::memory_order_release);
+  }
+
+  bool rowDone(int y) const {
+    return rows[y].load(std::memory_order_acquire) != 0;
+  }
+
+  // Writes a snapshot every interval seconds on a background thread until stop()
+  void start(int interval) {
+    worker = std::thread([this, interval]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while(!wake.wait_for(lock, std::chrono::seconds(interval), [this]() { return stopping; })) {
+        lock.unlock();
+        if(!write()) {
+          if(!failed) printf("Failed to write checkpoint %s\n", path.c_str());
+          failed = true;
+        }
+        lock.lock();
+      }
+    });
+  }
+
+  void stop() {
+    if(!worker.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  // Written to a temporary file first so a kill part way through never clobbers the last good checkpoint
+  bool write() {
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if(!file) return false;
+
+    CheckpointHeader header = MakeCheckpointHeader(framebuffer.width, framebuffer.height, max_samples, sampler, photons.size(), identity);
+    fwrite(&header, sizeof(header), 1, file);
+
+    for(size_t i = 0; i < photons.size(); i++) {
+      const Photon& p = photons[i];
+      float values[7] = { p.energy.r, p.energy.g, p.energy.b, p.position.x, p.position.y, p.position.z, p.position.w };
+      fwrite(values, sizeof(float), 7, file);
+    }
+
+    //Flags are read once so the pixels written below agree with them
+    std::vector<uint8_t> done(framebuffer.height);
+    for(int y = 0; y < framebuffer.height; y++) done[y] = rowDone(y) ? 1 : 0;
+    fwrite(done.data(), 1, done.size(), file);
+
+    std::vector<PixelStats> empty(framebuffer.width);
+    for(int y = 0; y < framebuffer.height; y++) {
+      const PixelStats* row = done[y] ? &framebuffer.pixels[(size_t)y * framebuffer.width] : empty.data();
+      fwrite(row, sizeof(PixelStats), framebuffer.width, file);
+    }
+
+    bool ok = !ferror(file);
+    ok = (fclose(file) == 0) && ok;
+    return ok && rename(temporary.c_str(), path.c_str()) == 0;
+  }
+
+private:
+  std::string path;
+  const Framebuffer& framebuffer;
+  const std::vector<Photon>& photons;
+  int max_samples;
+  int sampler;
+  CheckpointIdentity identity;
+
+  std::atomic<uint8_t>* rows;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  bool failed;
+};
+
+// Restores a checkpoint written for the same resolution, sample budget, scene, camera and render settings. Fills framebuffer,
+// the row flags and photons, and returns the sampler it was rendered with through sampler. Prints why on failure.
+bool LoadCheckpoint(const std::string& path, Framebuffer& framebuffer, std::vector<uint8_t>& done,
+                    std::vector<Photon>& photons, int max_samples, const CheckpointIdentity& identity, int& sampler) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file) {
+    printf("Cannot open checkpoint %s\n", path.c_str());
+    return false;
+  }
+
+  CheckpointHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1;
+  if(!ok || memcmp(header.magic, "RTCK", 4) != 0 || header.version != CHECKPOINT_VERSION) {
+    printf("%s is not a checkpoint this build can read\n", path.c_str());
+    fclose(file);
+    return false;
+  }
+  if((int)header.width != framebuffer.width || (int)header.height != framebuffer.height || (int)header.max_samples != max_samples) {
+    printf("Checkpoint was rendered at %ux%u with --spp %u, rerun with the same settings\n",
+      header.width, header.height, header.max_samples);
+    fclose(file);
+    return false;
+  }
+  if(header.identity.scene_hash != identity.scene_hash) {
+    printf("Checkpoint was rendered from a different scene (geometry, materials or lights), rerun with the same scene\n");
+    fclose(file);
+    return false;
+  }
+  if(header.identity.camera_hash != identity.camera_hash) {
+    printf("Checkpoint was rendered from a different camera, rerun with the same view\n");
+    fclose(file);
+    return false;
+  }
+  if(!SameSettings(header.identity.settings, identity.settings)) {
+    const RenderSettings& s = header.identity.settings;
+    printf("Checkpoint was rendered with --indirect-depth %d --indirect-rays %d --bounce-depth %d --light-samples %d "
+      "--photons %d --photon-radius %g, rerun with the same settings\n", s.monte_carlo_depth, s.monte_carlo_breadth,
+      s.refraction_depth, s.light_samples, s.photon_samples, s.radiance_size);
+    fclose(file);
+    return false;
+  }
+
+  photons.clear();
+  photons.reserve(header.photon_count);
+  for(uint64_t i = 0; ok && i < header.photon_count; i++) {
+    float v[7];
+    ok = fread(v, sizeof(float), 7, file) == 7;
+    photons.push_back(Photon(vec3(v[0], v[1], v[2]), vec4(v[3], v[4], v[5], v[6])));
+  }
+
+  done.resize(framebuffer.height);
+  ok = ok && fread(done.data(), 1, done.size(), file) == done.size();
+  ok = ok && fread(framebuffer.pixels.data(), sizeof(PixelStats), framebuffer.pixels.size(), file) == framebuffer.pixels.size();
+  fclose(file);
+
+  if(!ok) {
+    printf("Checkpoint %s is truncated\n", path.c_str());
+    return false;
+  }
+  sampler = header.sampler;
+  return true;
+}
+
+#endif
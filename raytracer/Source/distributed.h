@@ -0,0 +1,398 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "settings.h"
+
+// Coordinator / worker tile rendering over TCP. The coordinator hands out tile indices a couple at a time
+// per worker, so faster workers simply come back for more, and puts a worker's outstanding tiles back in
+// the queue if its connection drops or it goes longer than the tile timeout without returning a tile.
+// Workers can join at any point while the frame is rendering.
+//
+// Every message is a MessageHeader followed by length bytes of payload:
+//   worker -> coordinator  HELLO  (uint32 protocol version)
+//   coordinator -> worker  JOB    (JobMessage), sent once in reply to HELLO
+//   coordinator -> worker  TILE   (uint32 tile index)
+//   worker -> coordinator  RESULT (uint32 tile index, then the tile's raw payload)
+//   coordinator -> worker  DONE   (empty), the frame is complete
+// Payloads are raw structs, so both ends must run the same build.
+
+const uint32_t PROTOCOL_VERSION = 2;
+// Tiles in flight per worker, one being rendered and one queued to hide the round trip
+const int TILES_IN_FLIGHT = 2;
+// How often the coordinator wakes without traffic to check on its worker processes and tile deadlines
+const int COORDINATOR_POLL_MS = 1000;
+
+enum MessageType {
+  MSG_HELLO = 1,
+  MSG_JOB,
+  MSG_TILE,
+  MSG_RESULT,
+  MSG_DONE
+};
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t length;
+};
+
+struct JobMessage {
+  uint32_t width;
+  uint32_t height;
+  uint32_t max_samples;
+  uint32_t sampler;
+  uint32_t tile_size;
+  RenderSettings settings;
+};
+
+bool SendAll(int fd, const void* data, size_t length) {
+  const char* bytes = (const char*)data;
+  while(length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if(sent < 0 && errno == EINTR) continue;
+    if(sent <= 0) return false;
+    bytes += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+bool RecvAll(int fd, void* data, size_t length) {
+  char* bytes = (char*)data;
+  while(length > 0) {
+    ssize_t received = recv(fd, bytes, length, 0);
+    if(received < 0 && errno == EINTR) continue;
+    if(received <= 0) return false;
+    bytes += received;
+    length -= received;
+  }
+  return true;
+}
+
+bool SendMessage(int fd, uint32_t type, const void* payload, size_t length, const void* extra = NULL, size_t extra_length = 0) {
+  MessageHeader header = { type, (uint32_t)(length + extra_length) };
+  return SendAll(fd, &header, sizeof(header)) && SendAll(fd, payload, length) && SendAll(fd, extra, extra_length);
+}
+
+bool RecvMessage(int fd, MessageHeader& header, std::vector<uint8_t>& payload) {
+  if(!RecvAll(fd, &header, sizeof(header))) return false;
+  payload.resize(header.length);
+  return RecvAll(fd, payload.data(), header.length);
+}
+
+// Listens on every interface, port 0 picks a free port which is written back
+int ListenOn(int& port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0) return -1;
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  socklen_t length = sizeof(address);
+  if(bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 64) < 0 ||
+     getsockname(fd, (sockaddr*)&address, &length) < 0) {
+    close(fd);
+    return -1;
+  }
+  port = ntohs(address.sin_port);
+  return fd;
+}
+
+// host:port
+int ConnectTo(const std::string& endpoint) {
+  size_t colon = endpoint.find_last_of(':');
+  if(colon == std::string::npos) return -1;
+  std::string host = endpoint.substr(0, colon);
+  std::string port = endpoint.substr(colon + 1);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* results;
+  if(getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) return -1;
+
+  int fd = -1;
+  for(addrinfo* r = results; r && fd < 0; r = r->ai_next) {
+    fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+    if(fd >= 0 && connect(fd, r->ai_addr, r->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(results);
+
+  if(fd >= 0) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+// Runs the coordinator side until every tile has come back. deliver(index, payload) receives each finished
+// tile exactly once, from this thread; payloads of any other size than tile_bytes count as a failed worker.
+// children are the worker processes started for this frame, they are reaped as they exit and taken off the
+// list. Returns false if it gave up: no worker is connected and either every child has exited or none has
+// connected for the tile timeout, so nothing is going to render the tiles still missing. Without children it
+// keeps waiting for workers to join.
+class Coordinator {
+public:
+  typedef std::function<void(int, const uint8_t*)> Deliver;
+
+  Coordinator(int listen_fd, const JobMessage& job, int tile_count, size_t tile_bytes, int tile_timeout,
+              std::vector<pid_t>& children)
+    : listen_fd(listen_fd), job(job), tile_count(tile_count), tile_bytes(tile_bytes), tile_timeout(tile_timeout),
+      children(children)
+  {
+
+  }
+
+  bool run(Deliver deliver) {
+    std::vector<uint8_t> done(tile_count, 0);
+    int remaining = tile_count;
+    for(int i = 0; i < tile_count; i++) queue.push_back(i);
+    bool spawned = !children.empty();
+    Clock::time_point connected = Clock::now();   // last time a worker was connected
+
+    while(remaining > 0) {
+      reapChildren();
+      if(!workers.empty()) connected = Clock::now();
+      else if(spawned && (children.empty() || Clock::now() - connected >= std::chrono::seconds(tile_timeout))) {
+        printf("No workers left, %d of %d tiles were not rendered\n", remaining, tile_count);
+        return false;
+      }
+
+      std::vector<pollfd> fds(1 + workers.size());
+      fds[0].fd = listen_fd;
+      fds[0].events = POLLIN;
+      for(size_t i = 0; i < workers.size(); i++) {
+        fds[i + 1].fd = workers[i].fd;
+        fds[i + 1].events = POLLIN;
+      }
+      if(poll(fds.data(), fds.size(), COORDINATOR_POLL_MS) < 0) {
+        if(errno == EINTR) continue;
+        perror("poll");
+        return false;
+      }
+
+      if(fds[0].revents & POLLIN) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd >= 0) {
+          int yes = 1;
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+          workers.push_back(Worker(fd));
+        }
+      }
+
+      for(size_t i = 0; i < fds.size() - 1; i++) {
+        if(!fds[i + 1].revents) continue;
+        Worker& worker = workers[i];
+        if(!receive(worker, done, remaining, deliver)) drop(worker, done);
+      }
+
+      //A worker that is connected but has stopped returning tiles is treated like one that disconnected
+      Clock::time_point now = Clock::now();
+      for(size_t i = 0; i < workers.size(); i++) {
+        Worker& worker = workers[i];
+        if(worker.fd < 0 || worker.tiles.empty() || now - worker.progress < std::chrono::seconds(tile_timeout)) continue;
+        printf("Worker has not returned a tile in %d s\n", tile_timeout);
+        drop(worker, done);
+      }
+
+      //Re-issued tiles go to whoever has room now, otherwise to the next worker that reports back
+      for(size_t i = 0; i < workers.size(); i++) {
+        if(workers[i].fd >= 0 && workers[i].ready && !assign(workers[i], done)) drop(workers[i], done);
+      }
+
+      //Dropped workers are removed after the loop so fds and workers stay in step while scanning
+      for(size_t i = 0; i < workers.size();) {
+        if(workers[i].fd < 0) workers.erase(workers.begin() + i);
+        else i++;
+      }
+    }
+
+    for(size_t i = 0; i < workers.size(); i++) {
+      SendMessage(workers[i].fd, MSG_DONE, NULL, 0);
+      close(workers[i].fd);
+    }
+    workers.clear();
+    return true;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Worker {
+    int fd;
+    bool ready;
+    std::vector<int> tiles;      // handed out, not yet returned
+    std::vector<uint8_t> buffer; // bytes received but not yet parsed
+    Clock::time_point progress;  // last time a tile came back, or was handed out while it had none
+
+    Worker(int fd) : fd(fd), ready(false) {}
+  };
+
+  int listen_fd;
+  JobMessage job;
+  int tile_count;
+  size_t tile_bytes;
+  int tile_timeout;   // seconds
+  std::vector<pid_t>& children;
+  std::deque<int> queue;
+  std::vector<Worker> workers;
+
+  void reapChildren() {
+    for(size_t i = 0; i < children.size();) {
+      int status;
+      pid_t pid = waitpid(children[i], &status, WNOHANG);
+      if(pid == 0) {
+        i++;
+        continue;
+      }
+      if(pid > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) printf("Worker process %d failed\n", (int)pid);
+      children.erase(children.begin() + i);
+    }
+  }
+
+  //Reads what has arrived and handles every complete message, false if the worker has to go
+  bool receive(Worker& worker, std::vector<uint8_t>& done, int& remaining, Deliver& deliver) {
+    uint8_t chunk[65536];
+    ssize_t received = recv(worker.fd, chunk, sizeof(chunk), 0);
+    if(received <= 0) return received < 0 && errno == EINTR;
+    worker.buffer.insert(worker.buffer.end(), chunk, chunk + received);
+
+    size_t offset = 0;
+    while(worker.buffer.size() - offset >= sizeof(MessageHeader)) {
+      MessageHeader header;
+      memcpy(&header, &worker.buffer[offset], sizeof(header));
+      if(worker.buffer.size() - offset - sizeof(header) < header.length) break;
+      const uint8_t* payload = &worker.buffer[offset + sizeof(header)];
+      offset += sizeof(header) + header.length;
+
+      if(header.type == MSG_HELLO) {
+        uint32_t version = 0;
+        if(header.length == sizeof(version)) memcpy(&version, payload, sizeof(version));
+        if(version != PROTOCOL_VERSION) {
+          printf("Rejecting worker with protocol version %u\n", version);
+          return false;
+        }
+        if(!SendMessage(worker.fd, MSG_JOB, &job, sizeof(job))) return false;
+        worker.ready = true;
+      } else if(header.type == MSG_RESULT && worker.ready && header.length == sizeof(uint32_t) + tile_bytes) {
+        uint32_t index;
+        memcpy(&index, payload, sizeof(index));
+        std::vector<int>::iterator it = std::find(worker.tiles.begin(), worker.tiles.end(), (int)index);
+        if(it == worker.tiles.end()) return false;
+        worker.tiles.erase(it);
+        worker.progress = Clock::now();
+        //Only the first copy of a tile counts, whichever worker it came from
+        if(!done[index]) {
+          done[index] = 1;
+          remaining--;
+          deliver(index, payload + sizeof(uint32_t));
+        }
+      } else {
+        return false;
+      }
+    }
+    worker.buffer.erase(worker.buffer.begin(), worker.buffer.begin() + offset);
+    return true;
+  }
+
+  bool assign(Worker& worker, const std::vector<uint8_t>& done) {
+    while((int)worker.tiles.size() < TILES_IN_FLIGHT && !queue.empty()) {
+      uint32_t index = queue.front();
+      queue.pop_front();
+      if(done[index]) continue;
+      if(worker.tiles.empty()) worker.progress = Clock::now();
+      worker.tiles.push_back(index);
+      if(!SendMessage(worker.fd, MSG_TILE, &index, sizeof(index))) return false;
+    }
+    return true;
+  }
+
+  //Anything the worker still owed goes back to the front of the queue for the next worker that asks
+  void drop(Worker& worker, const std::vector<uint8_t>& done) {
+    int requeued = 0;
+    for(size_t i = 0; i < worker.tiles.size(); i++) {
+      if(done[worker.tiles[i]]) continue;
+      queue.push_front(worker.tiles[i]);
+      requeued++;
+    }
+    if(requeued) printf("Worker lost, re-issuing %d tiles\n", requeued);
+    close(worker.fd);
+    worker.fd = -1;
+    worker.tiles.clear();
+  }
+};
+
+// Worker side: connects, calls setup(job) once, then render(index, payload) per tile until the coordinator
+// says the frame is done. Returns false if the connection fails.
+bool RunWorker(const std::string& endpoint, std::function<void(const JobMessage&)> setup,
+               std::function<void(int, std::vector<uint8_t>&)> render) {
+  int fd = ConnectTo(endpoint);
+  if(fd < 0) {
+    printf("Cannot connect to coordinator %s\n", endpoint.c_str());
+    return false;
+  }
+
+  uint32_t version = PROTOCOL_VERSION;
+  MessageHeader header;
+  std::vector<uint8_t> payload;
+  if(!SendMessage(fd, MSG_HELLO, &version, sizeof(version)) || !RecvMessage(fd, header, payload) ||
+     header.type != MSG_JOB || header.length != sizeof(JobMessage)) {
+    printf("Coordinator %s did not send a job\n", endpoint.c_str());
+    close(fd);
+    return false;
+  }
+  JobMessage job;
+  memcpy(&job, payload.data(), sizeof(job));
+  setup(job);
+
+  std::vector<uint8_t> result;
+  bool ok = true;
+  while(true) {
+    if(!RecvMessage(fd, header, payload)) {
+      ok = false;
+      break;
+    }
+    if(header.type == MSG_DONE) break;
+    if(header.type != MSG_TILE || header.length != sizeof(uint32_t)) {
+      ok = false;
+      break;
+    }
+    uint32_t index;
+    memcpy(&index, payload.data(), sizeof(index));
+    render(index, result);
+    if(!SendMessage(fd, MSG_RESULT, &index, sizeof(index), result.data(), result.size())) {
+      ok = false;
+      break;
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+using glm::vec3;
+
+// Per pixel running estimate, luminance moments are kept to decide when a pixel has converged
+class PixelStats {
+public:
+  vec3 sum;
+  float luminance_sum;
+  float luminance_sq_sum;
+  int samples;
+
+  PixelStats()
+    : sum(0, 0, 0), luminance_sum(0), luminance_sq_sum(0), samples(0)
+  {
+
+  }
+
+  void add(vec3 colour) {
+    float luminance = (0.2126f * colour.r) + (0.7152f * colour.g) + (0.0722f * colour.b);
+    sum += colour;
+    luminance_sum += luminance;
+    luminance_sq_sum += luminance * luminance;
+    samples++;
+  }
+
+  vec3 mean() const {
+    if(samples == 0) return vec3(0, 0, 0);
+    return sum / ((float)samples);
+  }
+
+  // Standard error of the mean luminance, relative to the luminance itself
+  float relativeError() const {
+    if(samples < 2) return INFINITY;
+    float n = (float)samples;
+    float mean = luminance_sum / n;
+    float variance = ((luminance_sq_sum / n) - (mean * mean)) * (n / (n - 1));
+    if(variance < 0) variance = 0;
+    return sqrtf(variance / n) / (mean + 0.05f);
+  }
+
+  // Keeps the estimate but weights it as at most max_samples samples
+  void capHistory(int max_samples) {
+    if(samples <= max_samples) return;
+    float scale = ((float)max_samples) / ((float)samples);
+    sum *= scale;
+    luminance_sum *= scale;
+    luminance_sq_sum *= scale;
+    samples = max_samples;
+  }
+
+  bool converged(int min_samples, float threshold) const {
+    return samples >= min_samples && relativeError() < threshold;
+  }
+};
+
+class Framebuffer {
+public:
+  int width;
+  int height;
+  std::vector<PixelStats> pixels;
+
+  Framebuffer(int width, int height)
+    : width(width), height(height), pixels(width * height)
+  {
+
+  }
+
+  PixelStats& at(int x, int y) {
+    return pixels[(y * width) + x];
+  }
+
+  void clear() {
+    std::fill(pixels.begin(), pixels.end(), PixelStats());
+  }
+
+  // Flat linear RGB of count pixel means starting at pixel index first, for output and tone mapping
+  void resolve(float* rgb, size_t first, size_t count) const {
+    for(size_t i = 0; i < count; i++) {
+      vec3 colour = pixels[first + i].mean();
+      rgb[(i * 3) + 0] = colour.r;
+      rgb[(i * 3) + 1] = colour.g;
+      rgb[(i * 3) + 2] = colour.b;
+    }
+  }
+
+  // Bilinear lookup of the pixel means, (u, v) in [0, 1] across the whole buffer
+  vec3 sampleBilinear(float u, float v) {
+    float fx = glm::clamp((u * width) - 0.5f, 0.f, (float)(width - 1));
+    float fy = glm::clamp((v * height) - 0.5f, 0.f, (float)(height - 1));
+    int x0 = (int)fx, y0 = (int)fy;
+    int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    float tx = fx - x0, ty = fy - y0;
+    vec3 top = (at(x0, y0).mean() * (1 - tx)) + (at(x1, y0).mean() * tx);
+    vec3 bottom = (at(x0, y1).mean() * (1 - tx)) + (at(x1, y1).mean() * tx);
+    return (top * (1 - ty)) + (bottom * ty);
+  }
+};
+
+// 8-bit ARGB in the same layout PutPixelSDL writes
+uint32_t PackARGB(vec3 colour) {
+  uint32_t r = uint32_t( glm::clamp( 255*colour.r, 0.f, 255.f ) );
+  uint32_t g = uint32_t( glm::clamp( 255*colour.g, 0.f, 255.f ) );
+  uint32_t b = uint32_t( glm::clamp( 255*colour.b, 0.f, 255.f ) );
+  return (128<<24) + (r<<16) + (g<<8) + b;
+}
+
+// Blue for the fewest samples through green to red for the most. Red throughout when every pixel takes the
+// whole budget (--spp at or below MIN_SAMPLES).
+vec3 HeatmapColour(int samples, int min_samples, int max_samples) {
+  if(max_samples <= min_samples) return vec3(1, 0, 0);
+  float t = ((float)(samples - min_samples)) / ((float)(max_samples - min_samples));
+  t = glm::clamp(t, 0.f, 1.f);
+  if(t < 0.5f) return vec3(0, t * 2, 1 - (t * 2));
+  return vec3((t - 0.5f) * 2, 1 - ((t - 0.5f) * 2), 0);
+}
+
+#endif
@@ -1,6 +1,13 @@
 
 #include <glm/glm.hpp>
 #include <vector>
+#include <map>
+#include <stdint.h>
+#include <string.h>
+#include "mesh.h"
+#include "bvh.h"
+#include "instance.h"
+#include "spherepack.h"
 
 using glm::vec4;
 using glm::vec3;
@@ -36,6 +43,15 @@ public:
 
 };
 
+// Parts of the shader a material needs, a material's combination picks its kernel in MainShader
+enum MaterialFeature {
+	FEATURE_DIFFUSE = 1,
+	FEATURE_SPECULAR = 2,
+	FEATURE_REFLECT = 4,
+	FEATURE_REFRACT = 8,
+	FEATURE_COMBINATIONS = 16
+};
+
 class ShaderProperties {
 public:
 	glm::vec3 color;
@@ -46,14 +62,21 @@ public:
 	float reflectance;
 	float refractance;
 	float refractive_index;
+	uint32_t features;    // MaterialFeature bits, kept up to date by classify()
 
   ShaderProperties(glm::vec3 color, float material_ambient, float material_diffuse, float material_specular, float material_shininess, float reflectance, float refractance, float refractive_index)
     : color(color), material_ambient(material_ambient), material_diffuse(material_diffuse), material_specular(material_specular), material_shininess(material_shininess), reflectance(reflectance), refractance(refractance), refractive_index(refractive_index)
   {
-
+    classify();
   }
 
-  ShaderProperties(){}
+  ShaderProperties() : features(0) {}
+
+  // Has to be called again after changing the material's fields
+  void classify() {
+    features = (material_diffuse > 0 ? FEATURE_DIFFUSE : 0) | (material_specular > 0 ? FEATURE_SPECULAR : 0) |
+               (reflectance > 0 ? FEATURE_REFLECT : 0) | (refractance > 0 ? FEATURE_REFRACT : 0);
+  }
 
 };
 
@@ -103,42 +126,81 @@ public:
 
 class Scene {
 public:
+	Mesh scene_mesh;
+	std::vector<ShaderProperties> scene_materials;    // indexed by Mesh::materials
+	BVH scene_bvh;                                    // over scene_mesh, linear search when empty
+	std::vector<Prototype> scene_prototypes;          // meshes that are only placed through instances
+	std::vector<Instance> scene_instances;
+	BVH scene_instance_bvh;                           // top level, over scene_instances
 	std::vector<Triangle> scene_triangles;
 	std::vector<Sphere> scene_spheres;
+	BVH scene_sphere_bvh;                             // over scene_spheres, refitted when they move
+	SpherePack scene_sphere_pack;                     // scene_spheres in scene_sphere_bvh order
 	std::vector<PointLight> scene_lights;
 };
 
-void injectCustom(Scene &scene) {
-
-	// ShaderProperties(color, material_ambient, material_diffuse, material_specular, material_shininess, reflectance, refractance, refractive_index)
-
-
-	scene.scene_spheres.push_back(
-		Sphere(vec4(0, 0, -0.7, 1), 0.2f, ShaderProperties(vec3(1, 1, 1), 0.01f, 0.f, 0.f, 8, 0.f, 1.0f, 1.5f))
-	);
-
-	scene.scene_spheres.push_back(
-		Sphere(vec4(0.4, -0.2, 0, 1), 0.15f, ShaderProperties(vec3(1.0f, 1.0f, 1.0f), 0.1, 0.1, 1.f, 10.0f, 0.9f, 0, 1))
-	);
-
-	float light_size = 0.1f;
-	scene.scene_lights.push_back(
-		PointLight(vec4( 0, -0.5, -0.7, 1.0), vec3( 1, 1, 1 ), 0.1f, 14.0f, 14.0f, vec3(0, 0, 12.5), vec4(light_size, 0, 0, 1.0), vec4(0, 0, light_size, 1.0))
-	);
-	// scene.scene_lights.push_back(
-	// 	PointLight(vec4( -0.7, 0.7, -0.7, 1.0), vec3( 1, 0, 0 ), 0.1f, 7.0f, 7.0f, vec3(0, 0, 12.5), vec4(light_size, 0, 0, 1.0), vec4(0, 0, light_size, 1.0))
-	// );
-
-	// scene.scene_lights.push_back(
-	// 	PointLight(vec4( 0.7, 0.5, -0.7, 1.0), vec3( 1, 0.1, 0.2 ), 0.1f, 4.0f, 0.2f, vec3(0, 0, 32.0))
-	// );
+struct VertexOrder {
+	bool operator()(const vec3& a, const vec3& b) const
+	{
+		if(a.x != b.x) return a.x < b.x;
+		if(a.y != b.y) return a.y < b.y;
+		return a.z < b.z;
+	}
+};
 
-	// scene.scene_lights.push_back(
-	// 	PointLight(vec4( 0, 0.5, -0.7, 1.0), vec3( 0, 0, 0 ), 0.5f, 14.0f, 14.0f, vec3(0, 0, 12.0))
-	// );
+// Moves loose triangles into the scene's mesh, merging corners at identical positions and identical materials
+void AddTriangles(Scene &scene, const std::vector<Triangle>& triangles) {
+	std::map<vec3, uint32_t, VertexOrder> vertices;
+	Mesh& mesh = scene.scene_mesh;
+	mesh.indices.reserve(mesh.indices.size() + (triangles.size() * 3));
+	mesh.materials.reserve(mesh.materials.size() + triangles.size());
+
+	for(size_t i = 0; i < triangles.size(); i++) {
+		const Triangle& triangle = triangles[i];
+
+		uint32_t corners[3];
+		const vec4* points[3] = { &triangle.v0, &triangle.v1, &triangle.v2 };
+		for(int c = 0; c < 3; c++) {
+			vec3 position = vec3(*points[c]);
+			std::map<vec3, uint32_t, VertexOrder>::iterator found = vertices.find(position);
+			if(found == vertices.end()) {
+				found = vertices.insert(std::make_pair(position, mesh.addVertex(position))).first;
+			}
+			corners[c] = found->second;
+		}
+
+		//Only a handful of materials per model, a linear search is fine
+		uint32_t material = 0;
+		while(material < scene.scene_materials.size() &&
+		      memcmp(&scene.scene_materials[material], &triangle.properties, sizeof(ShaderProperties)) != 0) {
+			material++;
+		}
+		if(material == scene.scene_materials.size()) scene.scene_materials.push_back(triangle.properties);
+
+		mesh.addFace(corners[0], corners[1], corners[2], material);
+	}
+}
 
-	// scene.scene_lights.push_back(
-	// 	PointLight(vec4( -0.8, -0.5, -0.7, 1.0), vec3( 1, 1, 1 ), 0.5f, 14.0f, 14.0f, vec3(0, 0, 12.0))
-	// );
+// Keeps scene_sphere_bvh over scene_spheres, refitting it when the spheres have only moved, and lays out
+// scene_sphere_pack to match. True if refitted.
+bool UpdateSphereBVH(Scene &scene) {
+	size_t count = scene.scene_spheres.size();
+	std::vector<vec3> lows(count), highs(count);
+	for(size_t i = 0; i < count; i++) {
+		vec3 center = vec3(scene.scene_spheres[i].origin);
+		vec3 extent = vec3(fabsf(scene.scene_spheres[i].radius));
+		lows[i] = center - extent;
+		highs[i] = center + extent;
+	}
+	scene.scene_sphere_bvh.leaf_size = SPHERE_LEAF_SIZE;
+	bool refitted = scene.scene_sphere_bvh.refit(lows, highs);
+	scene.scene_sphere_pack.update(scene.scene_spheres, scene.scene_sphere_bvh);
+	return refitted;
+}
 
+// Works out the features of every material in the scene once it is loaded
+void ClassifyMaterials(Scene &scene) {
+	for(size_t i = 0; i < scene.scene_materials.size(); i++) scene.scene_materials[i].classify();
+	for(size_t i = 0; i < scene.scene_triangles.size(); i++) scene.scene_triangles[i].properties.classify();
+	for(size_t i = 0; i < scene.scene_spheres.size(); i++) scene.scene_spheres[i].properties.classify();
 }
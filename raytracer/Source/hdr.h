@@ -0,0 +1,152 @@
+#ifndef HDR_H
+#define HDR_H
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+using glm::vec3;
+
+// Linear float output, nothing is clamped or quantised. Writers take pixel(x, y) -> vec3 and stream
+// the image out in one pass, so only a row (or a tile) is ever held besides the framebuffer itself.
+
+enum ImageFormat {
+  IMAGE_PNG,
+  IMAGE_PFM,
+  IMAGE_TILED_FLOAT
+};
+
+ImageFormat FormatFromPath(const std::string& path) {
+  size_t dot = path.find_last_of('.');
+  std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+  if(extension == ".pfm") return IMAGE_PFM;
+  if(extension == ".tfl") return IMAGE_TILED_FLOAT;
+  return IMAGE_PNG;
+}
+
+// Portable float map, RGB, little endian (negative scale), scanlines stored bottom to top
+template <typename Pixel>
+bool WritePFM(const std::string& path, int width, int height, Pixel pixel) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) return false;
+
+  fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+  std::vector<float> row(width * 3);
+  for(int y = height - 1; y >= 0; y--) {
+    for(int x = 0; x < width; x++) {
+      vec3 colour = pixel(x, y);
+      row[(x * 3) + 0] = colour.r;
+      row[(x * 3) + 1] = colour.g;
+      row[(x * 3) + 2] = colour.b;
+    }
+    fwrite(row.data(), sizeof(float), row.size(), file);
+  }
+
+  bool ok = !ferror(file);
+  return (fclose(file) == 0) && ok;
+}
+
+// Tiled float format (.tfl): a 32 byte header followed by every tile in row major tile order.
+// Each tile is a fixed size slot of tile_size x tile_size RGB floats, rows top to bottom, with the
+// part hanging over the image edge zero filled, so tile i always starts at
+// sizeof(TiledFloatHeader) + i * TiledFloatTileBytes(tile_size).
+const uint32_t TILED_FLOAT_VERSION = 1;
+const int TILED_FLOAT_TILE_SIZE = 64;
+
+struct TiledFloatHeader {
+  char magic[4];       // "TFLT"
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t tile_size;
+  uint32_t channels;   // always 3
+  uint32_t reserved[2];
+};
+
+TiledFloatHeader MakeTiledFloatHeader(int width, int height, int tile_size) {
+  TiledFloatHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "TFLT", 4);
+  header.version = TILED_FLOAT_VERSION;
+  header.width = width;
+  header.height = height;
+  header.tile_size = tile_size;
+  header.channels = 3;
+  return header;
+}
+
+size_t TiledFloatTileBytes(int tile_size) {
+  return ((size_t)tile_size) * tile_size * 3 * sizeof(float);
+}
+
+// Fills one tile slot, tile_x/tile_y count tiles rather than pixels
+template <typename Pixel>
+void GatherTile(std::vector<float>& tile, int tile_x, int tile_y, int tile_size, int width, int height, Pixel pixel) {
+  tile.assign(((size_t)tile_size) * tile_size * 3, 0.f);
+  for(int ty = 0; ty < tile_size; ty++) {
+    int y = (tile_y * tile_size) + ty;
+    if(y >= height) break;
+    for(int tx = 0; tx < tile_size; tx++) {
+      int x = (tile_x * tile_size) + tx;
+      if(x >= width) break;
+      vec3 colour = pixel(x, y);
+      float* out = &tile[((ty * tile_size) + tx) * 3];
+      out[0] = colour.r;
+      out[1] = colour.g;
+      out[2] = colour.b;
+    }
+  }
+}
+
+template <typename Pixel>
+bool WriteTiledFloat(const std::string& path, int width, int height, int tile_size, Pixel pixel) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) return false;
+
+  TiledFloatHeader header = MakeTiledFloatHeader(width, height, tile_size);
+  fwrite(&header, sizeof(header), 1, file);
+
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  std::vector<float> tile;
+  for(int tile_y = 0; tile_y < tiles_y; tile_y++) {
+    for(int tile_x = 0; tile_x < tiles_x; tile_x++) {
+      GatherTile(tile, tile_x, tile_y, tile_size, width, height, pixel);
+      fwrite(tile.data(), sizeof(float), tile.size(), file);
+    }
+  }
+
+  bool ok = !ferror(file);
+  return (fclose(file) == 0) && ok;
+}
+
+// Tone mapping, applied after rendering to a flat linear RGB buffer
+enum TonemapOperator {
+  TONEMAP_CLAMP,      // what the 8-bit output always did
+  TONEMAP_REINHARD
+};
+
+// exposure is in stops. Written as a straight loop over independent pixels so it vectorises. Only vectorised,
+// callers tone map a row at a time from threads of their own.
+void Tonemap(const float* rgb, uint8_t* rgba, size_t count, float exposure, TonemapOperator op) {
+  const float scale = exp2f(exposure);
+  const bool reinhard = op == TONEMAP_REINHARD;
+
+  #pragma omp simd
+  for(size_t i = 0; i < count; i++) {
+    for(int c = 0; c < 3; c++) {
+      float v = rgb[(i * 3) + c] * scale;
+      v = reinhard ? v / (1.f + v) : v;
+      v = fminf(fmaxf(v * 255.f, 0.f), 255.f);
+      rgba[(i * 4) + c] = (uint8_t)v;
+    }
+    rgba[(i * 4) + 3] = 0xFF;
+  }
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include "mesh.h"
+#include "bvh.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+// Instanced geometry. A Prototype is a mesh with its own BVH in object space, an Instance places a prototype
+// in the world with an affine transform. Instances are found through a top level BVH over their world bounds
+// and rays are moved into object space rather than the geometry into the world, so memory grows with the
+// unique meshes and only a transform pair per copy.
+//
+// Rays keep their unnormalised direction through the transform, so hit distances along them stay the same in
+// both spaces and can be compared directly with hits on other geometry.
+
+class Prototype {
+public:
+  Mesh mesh;
+  BVH bvh;
+};
+
+// 3x4 row major [rotation and scale | translation], for object to world and the inverse
+struct Instance {
+  uint32_t prototype;
+  float to_world[12];
+  float to_object[12];
+};
+
+inline vec3 TransformPoint(const float* m, vec3 p) {
+  return vec3((m[0] * p.x) + (m[1] * p.y) + (m[2] * p.z) + m[3],
+              (m[4] * p.x) + (m[5] * p.y) + (m[6] * p.z) + m[7],
+              (m[8] * p.x) + (m[9] * p.y) + (m[10] * p.z) + m[11]);
+}
+
+inline vec3 TransformDirection(const float* m, vec3 d) {
+  return vec3((m[0] * d.x) + (m[1] * d.y) + (m[2] * d.z),
+              (m[4] * d.x) + (m[5] * d.y) + (m[6] * d.z),
+              (m[8] * d.x) + (m[9] * d.y) + (m[10] * d.z));
+}
+
+// Normals go to the world by the transpose of to_object
+inline vec3 TransformNormal(const Instance& instance, vec3 n) {
+  const float* m = instance.to_object;
+  return glm::normalize(vec3((m[0] * n.x) + (m[4] * n.y) + (m[8] * n.z),
+                             (m[1] * n.x) + (m[5] * n.y) + (m[9] * n.z),
+                             (m[2] * n.x) + (m[6] * n.y) + (m[10] * n.z)));
+}
+
+Instance MakeInstance(uint32_t prototype, const mat4& to_world) {
+  Instance instance;
+  instance.prototype = prototype;
+  mat4 to_object = glm::inverse(to_world);
+  //glm is column major
+  for(int row = 0; row < 3; row++) {
+    for(int column = 0; column < 4; column++) {
+      instance.to_world[(row * 4) + column] = to_world[column][row];
+      instance.to_object[(row * 4) + column] = to_object[column][row];
+    }
+  }
+  return instance;
+}
+
+// Top level BVH over the world bounds of every instance, from the root boxes of their prototypes' BVHs
+void BuildInstanceBVH(const std::vector<Prototype>& prototypes, const std::vector<Instance>& instances, BVH& bvh) {
+  std::vector<vec3> lows(instances.size()), highs(instances.size());
+  #pragma omp parallel for
+  for(size_t i = 0; i < instances.size(); i++) {
+    const BVH& object = prototypes[instances[i].prototype].bvh;
+    if(object.empty()) {
+      //Nothing to hit, an inverted box is never entered
+      lows[i] = vec3(1e30f);
+      highs[i] = vec3(-1e30f);
+      continue;
+    }
+    const BVHNode& root = object.nodes[0];
+    lows[i] = vec3(1e30f);
+    highs[i] = vec3(-1e30f);
+    for(int corner = 0; corner < 8; corner++) {
+      vec3 p((corner & 1) ? root.high[0] : root.low[0],
+             (corner & 2) ? root.high[1] : root.low[1],
+             (corner & 4) ? root.high[2] : root.low[2]);
+      vec3 world = TransformPoint(instances[i].to_world, p);
+      lows[i] = glm::min(lows[i], world);
+      highs[i] = glm::max(highs[i], world);
+    }
+  }
+  bvh.build(lows, highs);
+}
+
+#endif
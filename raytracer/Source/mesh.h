@@ -0,0 +1,116 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+using glm::vec3;
+
+// Array that either owns its elements or borrows them from memory kept alive elsewhere, such as a mapped scene
+// file. Reads go through one pointer either way; anything that changes a borrowed array copies it first.
+template <typename T>
+class SharedArray
+{
+public:
+  SharedArray() : view(NULL), count(0), borrowed(false) {}
+
+  SharedArray(const SharedArray& other)
+    : owned(other.owned), count(other.count), borrowed(other.borrowed)
+  {
+    view = borrowed ? other.view : owned.data();
+  }
+
+  SharedArray& operator=(const SharedArray& other)
+  {
+    if(this != &other) {
+      owned = other.owned;
+      count = other.count;
+      borrowed = other.borrowed;
+      view = borrowed ? other.view : owned.data();
+    }
+    return *this;
+  }
+
+  void borrow(const T* elements, size_t size)
+  {
+    std::vector<T>().swap(owned);
+    view = elements;
+    count = size;
+    borrowed = true;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T* data() const { return view; }
+  const T& operator[](size_t i) const { return view[i]; }
+
+  T* data() { own(); return owned.data(); }
+  T& operator[](size_t i) { return data()[i]; }
+  void push_back(const T& value) { own(); owned.push_back(value); sync(); }
+  void resize(size_t size) { own(); owned.resize(size); sync(); }
+  void reserve(size_t size) { own(); owned.reserve(size); sync(); }
+
+private:
+  std::vector<T> owned;
+  const T* view;
+  size_t count;
+  bool borrowed;
+
+  void own()
+  {
+    if(!borrowed) return;
+    owned.assign(view, view + count);
+    borrowed = false;
+    sync();
+  }
+
+  void sync()
+  {
+    view = owned.data();
+    count = owned.size();
+  }
+};
+
+// Triangles as an indexed face set. Vertices are stored once and shared by every face that uses them, a
+// face is three indices into positions plus an index into the scene's material table, and face normals are
+// worked out at hit time rather than stored. That is 16 bytes per face plus the shared vertices, where a
+// Triangle carries its own corners, normal and material in 112.
+class Mesh
+{
+public:
+  SharedArray<vec3> positions;
+  SharedArray<uint32_t> indices;      // three per face
+  SharedArray<uint32_t> materials;    // one per face
+
+  size_t faceCount() const
+  {
+    return materials.size();
+  }
+
+  uint32_t addVertex(vec3 position)
+  {
+    positions.push_back(position);
+    return (uint32_t)(positions.size() - 1);
+  }
+
+  void addFace(uint32_t a, uint32_t b, uint32_t c, uint32_t material)
+  {
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+    materials.push_back(material);
+  }
+
+  // Same winding as Triangle::ComputeNormal
+  vec3 faceNormal(size_t face) const
+  {
+    const vec3& v0 = positions[indices[face * 3]];
+    vec3 e1 = positions[indices[(face * 3) + 1]] - v0;
+    vec3 e2 = positions[indices[(face * 3) + 2]] - v0;
+    return glm::normalize( glm::cross( e2, e1 ) );
+  }
+};
+
+#endif
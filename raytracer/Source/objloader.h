@@ -0,0 +1,314 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include "mesh.h"
+
+using glm::vec3;
+
+// Wavefront OBJ loader for large meshes. The file is mapped rather than read, cut into chunks at line breaks
+// and parsed by all threads in two passes: the first counts vertices and triangles per chunk so the mesh is
+// grown once and every chunk knows where its output goes, the second parses straight into place. Only v and
+// f lines are used, polygons are fanned into triangles and texture/normal indices are skipped. Anything
+// from a # to the end of a line is a comment.
+
+// More chunks than threads so chunks heavy on faces or comments even out
+const int OBJ_CHUNKS_PER_THREAD = 4;
+
+struct ObjChunk {
+  const char* begin;
+  const char* end;
+  size_t vertices;
+  size_t triangles;
+  size_t lines;
+  size_t error_line;   // 0 if the chunk parsed cleanly, otherwise the first bad line within the chunk
+};
+
+inline const char* SkipBlanks(const char* p, const char* end) {
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+  return p;
+}
+
+inline const char* NextLine(const char* p, const char* end) {
+  const char* newline = (const char*)memchr(p, '\n', end - p);
+  return newline ? newline + 1 : end;
+}
+
+// Where the line's content stops, at a # comment or the line break
+inline const char* ContentEnd(const char* line, const char* line_end) {
+  const char* comment = (const char*)memchr(line, '#', line_end - line);
+  return comment ? comment : line_end;
+}
+
+inline bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Decimal floats as written by modelling tools: sign, digits, fraction and exponent, no locale and no
+// iostreams. Up to 19 significant digits are kept, far more than a float holds. NULL if there is no number.
+inline const char* ParseObjFloat(const char* p, const char* end, float& value) {
+  static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  for(; p < end && IsDigit(*p); p++, any = true) {
+    if(digits < 19) {
+      mantissa = (mantissa * 10) + (*p - '0');
+      if(mantissa) digits++;
+    } else {
+      exponent++;
+    }
+  }
+  if(p < end && *p == '.') {
+    for(p++; p < end && IsDigit(*p); p++, any = true) {
+      if(digits < 19) {
+        mantissa = (mantissa * 10) + (*p - '0');
+        if(mantissa) digits++;
+        exponent--;
+      }
+    }
+  }
+  if(!any) return NULL;
+
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negative_exponent = false;
+    if(p < end && (*p == '-' || *p == '+')) negative_exponent = *p++ == '-';
+    if(p == end || !IsDigit(*p)) return NULL;
+    int e = 0;
+    for(; p < end && IsDigit(*p); p++) e = std::min((e * 10) + (*p - '0'), 10000);
+    exponent += negative_exponent ? -e : e;
+  }
+
+  double result = (double)mantissa;
+  while(exponent > 22) { result *= powers[22]; exponent -= 22; }
+  while(exponent < -22) { result /= powers[22]; exponent += 22; }
+  result = exponent >= 0 ? result * powers[exponent] : result / powers[-exponent];
+  value = (float)(negative ? -result : result);
+  return p;
+}
+
+// One face corner, "7", "7/2", "7//3" or "7/2/3", returns the position index. NULL if there is none.
+inline const char* ParseObjCorner(const char* p, const char* end, long& index) {
+  bool negative = false;
+  if(p < end && *p == '-') {
+    negative = true;
+    p++;
+  }
+  if(p == end || !IsDigit(*p)) return NULL;
+  long parsed = 0;
+  for(; p < end && IsDigit(*p); p++) parsed = (parsed * 10) + (*p - '0');
+  index = negative ? -parsed : parsed;
+  while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+  return p;
+}
+
+// 'v' or 'f' for the lines the loader uses, 0 for everything else, p is left after the keyword
+inline char ObjKeyword(const char*& p, const char* end) {
+  p = SkipBlanks(p, end);
+  if(end - p < 2 || (p[0] != 'v' && p[0] != 'f') || (p[1] != ' ' && p[1] != '\t')) return 0;
+  char keyword = p[0];
+  p += 2;
+  return keyword;
+}
+
+void CountObjChunk(ObjChunk& chunk) {
+  chunk.vertices = chunk.triangles = chunk.lines = 0;
+  for(const char* line = chunk.begin; line < chunk.end; chunk.lines++) {
+    const char* next = NextLine(line, chunk.end);
+    const char* line_end = ContentEnd(line, next);
+    const char* p = line;
+    char keyword = ObjKeyword(p, line_end);
+    if(keyword == 'v') {
+      chunk.vertices++;
+    } else if(keyword == 'f') {
+      size_t corners = 0;
+      for(p = SkipBlanks(p, line_end); p < line_end && *p != '\n'; p = SkipBlanks(p, line_end)) {
+        while(p < line_end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        corners++;
+      }
+      if(corners >= 3) chunk.triangles += corners - 2;
+    }
+    line = next;
+  }
+}
+
+// Writes the chunk's vertices from position first_vertex and its triangles from first_triangle. The file's
+// vertices start at mesh_vertex in the mesh, total_vertices of them.
+void ParseObjChunk(ObjChunk& chunk, Mesh& mesh, size_t mesh_vertex, size_t total_vertices,
+                   size_t first_vertex, size_t first_triangle, uint32_t material) {
+  size_t vertex = first_vertex;
+  size_t triangle = first_triangle;
+  size_t line_number = 0;
+  chunk.error_line = 0;
+
+  for(const char* line = chunk.begin; line < chunk.end && !chunk.error_line; line_number++) {
+    const char* next = NextLine(line, chunk.end);
+    const char* line_end = ContentEnd(line, next);
+    const char* p = line;
+    char keyword = ObjKeyword(p, line_end);
+
+    if(keyword == 'v') {
+      vec3& position = mesh.positions[mesh_vertex + vertex];
+      for(int axis = 0; axis < 3 && p; axis++) {
+        p = ParseObjFloat(SkipBlanks(p, line_end), line_end, position[axis]);
+      }
+      if(!p) chunk.error_line = line_number + 1;
+      vertex++;
+    } else if(keyword == 'f') {
+      uint32_t first = 0, previous = 0;
+      int corner = 0;
+      for(p = SkipBlanks(p, line_end); p < line_end && *p != '\n'; p = SkipBlanks(p, line_end), corner++) {
+        long index = 0;
+        p = ParseObjCorner(p, line_end, index);
+        if(!p || index == 0) {
+          chunk.error_line = line_number + 1;
+          break;
+        }
+        //Negative indices count back from the last vertex defined before this line
+        long resolved = index < 0 ? (long)vertex + index : index - 1;
+        if(resolved < 0 || resolved >= (long)total_vertices) {
+          chunk.error_line = line_number + 1;
+          break;
+        }
+
+        uint32_t current = (uint32_t)(mesh_vertex + resolved);
+        //OBJ faces are counter-clockwise from the front, the renderer's normals want them the other way
+        if(corner >= 2) {
+          uint32_t* corners = &mesh.indices[triangle * 3];
+          corners[0] = first;
+          corners[1] = current;
+          corners[2] = previous;
+          mesh.materials[triangle] = material;
+          triangle++;
+        }
+        if(corner == 0) first = current;
+        previous = current;
+      }
+    }
+    line = next;
+  }
+}
+
+// Appends the file's triangles to mesh, all with the given material. Prints why on failure and leaves the mesh
+// as it was.
+bool LoadOBJ(const std::string& path, Mesh& mesh, uint32_t material) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    printf("Cannot open mesh %s\n", path.c_str());
+    return false;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size == 0) {
+    printf("Mesh %s is empty\n", path.c_str());
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)info.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapped == MAP_FAILED) {
+    printf("Cannot map mesh %s\n", path.c_str());
+    return false;
+  }
+  madvise(mapped, size, MADV_WILLNEED);
+
+  //Chunks end just after a line break so no line is split between two of them
+  const char* data = (const char*)mapped;
+  const char* data_end = data + size;
+  int chunk_count = std::max(1, std::min((int)(size / 65536), omp_get_max_threads() * OBJ_CHUNKS_PER_THREAD));
+  std::vector<ObjChunk> chunks(chunk_count);
+  const char* begin = data;
+  for(int c = 0; c < chunk_count; c++) {
+    const char* end = c == chunk_count - 1 ? data_end : std::max(begin, data + ((size * (c + 1)) / chunk_count));
+    if(end < data_end) end = NextLine(end, data_end);
+    chunks[c].begin = begin;
+    chunks[c].end = end;
+    begin = end;
+  }
+
+  #pragma omp parallel for schedule(dynamic)
+  for(int c = 0; c < chunk_count; c++) {
+    CountObjChunk(chunks[c]);
+  }
+
+  std::vector<size_t> first_vertex(chunk_count), first_triangle(chunk_count), first_line(chunk_count);
+  size_t vertices = 0, triangles = 0, lines = 0;
+  for(int c = 0; c < chunk_count; c++) {
+    first_vertex[c] = vertices;
+    first_triangle[c] = triangles;
+    first_line[c] = lines;
+    vertices += chunks[c].vertices;
+    triangles += chunks[c].triangles;
+    lines += chunks[c].lines;
+  }
+
+  size_t mesh_vertex = mesh.positions.size();
+  size_t mesh_triangle = mesh.faceCount();
+  if(mesh_vertex + vertices > UINT32_MAX) {
+    printf("Mesh %s has too many vertices\n", path.c_str());
+    munmap(mapped, size);
+    return false;
+  }
+  mesh.positions.resize(mesh_vertex + vertices);
+  mesh.indices.resize((mesh_triangle + triangles) * 3);
+  mesh.materials.resize(mesh_triangle + triangles);
+
+  #pragma omp parallel for schedule(dynamic)
+  for(int c = 0; c < chunk_count; c++) {
+    ParseObjChunk(chunks[c], mesh, mesh_vertex, vertices, first_vertex[c], mesh_triangle + first_triangle[c], material);
+  }
+  munmap(mapped, size);
+
+  for(int c = 0; c < chunk_count; c++) {
+    if(chunks[c].error_line) {
+      printf("%s:%zu: cannot parse line\n", path.c_str(), first_line[c] + chunks[c].error_line);
+      mesh.positions.resize(mesh_vertex);
+      mesh.indices.resize(mesh_triangle * 3);
+      mesh.materials.resize(mesh_triangle);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Scales and moves the vertices from first on, uniformly, so their largest extent is size and they stand on
+// base. OBJ files are y up, the renderer is y down like the test model, so x and y are flipped as well.
+void PlaceMesh(Mesh& mesh, size_t first, vec3 base, float size) {
+  if(first >= mesh.positions.size()) return;
+  vec3 low = mesh.positions[first];
+  vec3 high = low;
+  for(size_t i = first; i < mesh.positions.size(); i++) {
+    low = glm::min(low, mesh.positions[i]);
+    high = glm::max(high, mesh.positions[i]);
+  }
+  vec3 extent = high - low;
+  float largest = std::max(extent.x, std::max(extent.y, extent.z));
+  float scale = largest > 0 ? size / largest : 1.0f;
+  vec3 bottom_center = vec3((low.x + high.x) / 2, low.y, (low.z + high.z) / 2);
+
+  vec3* positions = mesh.positions.data();
+  #pragma omp parallel for
+  for(size_t i = first; i < mesh.positions.size(); i++) {
+    vec3 p = (positions[i] - bottom_center) * scale;
+    positions[i] = base + vec3(-p.x, -p.y, p.z);
+  }
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdr.h"
+#include "settings.h"
+
+// Frame time (ms) the interactive view scales its resolution to hold while the camera moves
+const float DEFAULT_TARGET_FRAME_TIME = 30.0f;
+// Seconds the coordinator gives a worker to return a tile before handing its tiles to another worker
+const int DEFAULT_TILE_TIMEOUT = 300;
+
+// Command line settings, everything has a default so running without arguments opens the SDL view
+class RenderOptions {
+public:
+  bool headless;
+  int width;
+  int height;
+  int spp;       // per pixel sample budget for headless renders, adaptive sampling may stop earlier
+  int threads;   // 0 leaves the OpenMP default (OMP_NUM_THREADS)
+  float target_frame_time;  // ms, interactive view only
+  std::string output;   // .png is tone mapped, .pfm and .tfl keep the linear float values
+  float exposure;       // stops, only applied to tone mapped output
+  TonemapOperator tonemap;
+  int png_level;        // 0 store, 1 fast, 2 default, 3 best
+  bool resume;
+  std::string checkpoint;   // empty means next to the output
+  int checkpoint_interval;  // seconds
+  int coordinator_port;     // -1 renders locally, otherwise tiles are handed to workers, 0 picks a free port
+  int spawn_workers;        // local worker processes the coordinator starts itself
+  int tile_timeout;         // seconds a worker may take over a tile before it is given up on
+  std::string worker;       // host:port of the coordinator to render tiles for
+  std::string sequence;     // keyframe file, renders every frame of it to numbered outputs
+  std::string mesh;         // OBJ file placed in the box next to the test model
+  std::string scene;        // scene description or binary scene, instead of the default scene
+  std::string write_scene;  // converts the scene that would be rendered to a binary scene and exits
+  std::string bvh_cache;    // BVH kept between runs, rebuilt when the geometry no longer matches
+  RenderSettings settings;  // shader quality, passed on to workers
+  std::string stats;        // per frame ray counts and stage times as JSON lines, - for stdout
+
+  RenderOptions()
+    : headless(false), width(640), height(480), spp(64), threads(0), target_frame_time(DEFAULT_TARGET_FRAME_TIME), output("render.png"),
+      exposure(0), tonemap(TONEMAP_CLAMP), png_level(2),
+      resume(false), checkpoint(""), checkpoint_interval(60),
+      coordinator_port(-1), spawn_workers(0), tile_timeout(DEFAULT_TILE_TIMEOUT), worker(""), sequence(""), mesh(""), scene(""), write_scene(""), bvh_cache(""),
+      settings(DEFAULT_SETTINGS), stats("")
+  {
+
+  }
+};
+
+void PrintUsage(const char* program) {
+  printf("Usage: %s [options]\n", program);
+  printf("  --headless           render a single image to --output without opening a window\n");
+  printf("  --width <pixels>     image width (default 640)\n");
+  printf("  --height <pixels>    image height (default 480)\n");
+  printf("  --spp <samples>      maximum samples per pixel (default 64)\n");
+  printf("  --output <file>      headless output path, .png, .pfm or .tfl (tiled float),\n");
+  printf("                       a _spp.png heatmap is written next to png and pfm output.\n");
+  printf("                       .tfl renders tile by tile straight to disk, for images larger than memory\n");
+  printf("  --exposure <stops>   exposure applied when tone mapping to png (default 0)\n");
+  printf("  --tonemap <op>       clamp or reinhard (default clamp)\n");
+  printf("  --png-level <0-3>    png compression: 0 store, 1 fast, 2 default, 3 best (default 2)\n");
+  printf("  --checkpoint <file>  where progress is saved during headless renders (default <output>.checkpoint)\n");
+  printf("  --checkpoint-interval <seconds>  time between checkpoints (default 60)\n");
+  printf("  --resume             continue the render saved in the checkpoint, same settings required\n");
+  printf("  --sequence <file>    render the keyframed frames in file, output gets a frame number (or use %%04d)\n");
+  printf("  --coordinator <port> split the frame into tiles for worker processes instead of rendering it\n");
+  printf("  --spawn-workers <n>  start n local workers for the coordinator, threads are shared between them\n");
+  printf("  --tile-timeout <s>   seconds a worker may go without returning a tile before its tiles are\n");
+  printf("                       handed to other workers (default %d)\n", DEFAULT_TILE_TIMEOUT);
+  printf("  --worker <host:port> render tiles for a coordinator, resolution and spp come from it\n");
+  printf("  --mesh <file.obj>    add a Wavefront OBJ mesh to the scene, scaled to stand on the floor\n");
+  printf("  --scene <file>       render a scene description (see Scenes/) or a binary scene instead of the default\n");
+  printf("  --write-scene <file> save the scene, including --mesh, as a binary scene and exit\n");
+  printf("  --bvh-cache <file>   reuse the BVH saved in file if the geometry is unchanged, else build and save it\n");
+  printf("  --threads <count>    render threads (default OMP_NUM_THREADS)\n");
+  printf("  --target-frame-ms <ms>  frame time the interactive view lowers its resolution to hold while moving (default %g)\n",
+    DEFAULT_TARGET_FRAME_TIME);
+  printf("  --stats <file>       write ray counts and photon, render and encode times per frame as JSON lines (- for stdout,\n");
+  printf("                       progress then goes to stderr)\n");
+  printf("  --indirect-depth <n> bounces of indirect light (default %d)\n", DEFAULT_SETTINGS.monte_carlo_depth);
+  printf("  --indirect-rays <n>  indirect rays per bounce (default %d)\n", DEFAULT_SETTINGS.monte_carlo_breadth);
+  printf("  --bounce-depth <n>   reflection and refraction bounces (default %d)\n", DEFAULT_SETTINGS.refraction_depth);
+  printf("  --light-samples <n>  n x n shadow rays per light (default %d)\n", DEFAULT_SETTINGS.light_samples);
+  printf("  --photons <count>    caustic photons per light (default %d)\n", DEFAULT_SETTINGS.photon_samples);
+  printf("  --photon-radius <r>  caustic photon lookup radius (default %g)\n", DEFAULT_SETTINGS.radiance_size);
+  printf("                       the defaults render fastest, they have shaders compiled for them\n");
+  printf("  --help               show this message\n");
+}
+
+// Returns the value following a flag, or NULL with a message if it is missing
+const char* OptionValue(int& i, int argc, char* argv[]) {
+  if(i + 1 >= argc) {
+    printf("Missing value for %s\n", argv[i]);
+    return NULL;
+  }
+  return argv[++i];
+}
+
+bool ParsePositive(const char* value, int& target) {
+  if(!value) return false;
+  char* end;
+  long parsed = strtol(value, &end, 10);
+  if(*end != '\0' || parsed <= 0) {
+    printf("Expected a positive integer, got '%s'\n", value);
+    return false;
+  }
+  target = (int)parsed;
+  return true;
+}
+
+bool ParseFloat(const char* value, float& target) {
+  if(!value) return false;
+  char* end;
+  float parsed = strtof(value, &end);
+  if(*end != '\0' || end == value) {
+    printf("Expected a number, got '%s'\n", value);
+    return false;
+  }
+  target = parsed;
+  return true;
+}
+
+bool ParsePositiveFloat(const char* value, float& target) {
+  if(!value) return false;
+  char* end;
+  float parsed = strtof(value, &end);
+  if(*end != '\0' || end == value || !(parsed > 0)) {
+    printf("Expected a positive number, got '%s'\n", value);
+    return false;
+  }
+  target = parsed;
+  return true;
+}
+
+bool ParseTonemap(const char* value, TonemapOperator& target) {
+  if(!value) return false;
+  if(!strcmp(value, "clamp")) target = TONEMAP_CLAMP;
+  else if(!strcmp(value, "reinhard")) target = TONEMAP_REINHARD;
+  else {
+    printf("Unknown tone mapping operator '%s'\n", value);
+    return false;
+  }
+  return true;
+}
+
+bool ParseRange(const char* value, int low, int high, int& target) {
+  if(!value) return false;
+  char* end;
+  long parsed = strtol(value, &end, 10);
+  if(*end != '\0' || end == value || parsed < low || parsed > high) {
+    printf("Expected an integer from %d to %d, got '%s'\n", low, high, value);
+    return false;
+  }
+  target = (int)parsed;
+  return true;
+}
+
+bool ParseOptions(int argc, char* argv[], RenderOptions& options) {
+  for(int i = 1; i < argc; i++) {
+    const char* flag = argv[i];
+    bool ok = true;
+
+    if(!strcmp(flag, "--headless")) options.headless = true;
+    else if(!strcmp(flag, "--width")) ok = ParsePositive(OptionValue(i, argc, argv), options.width);
+    else if(!strcmp(flag, "--height")) ok = ParsePositive(OptionValue(i, argc, argv), options.height);
+    else if(!strcmp(flag, "--spp")) ok = ParsePositive(OptionValue(i, argc, argv), options.spp);
+    else if(!strcmp(flag, "--threads")) ok = ParsePositive(OptionValue(i, argc, argv), options.threads);
+    else if(!strcmp(flag, "--target-frame-ms")) ok = ParsePositiveFloat(OptionValue(i, argc, argv), options.target_frame_time);
+    else if(!strcmp(flag, "--exposure")) ok = ParseFloat(OptionValue(i, argc, argv), options.exposure);
+    else if(!strcmp(flag, "--tonemap")) ok = ParseTonemap(OptionValue(i, argc, argv), options.tonemap);
+    else if(!strcmp(flag, "--resume")) options.resume = true;
+    else if(!strcmp(flag, "--checkpoint-interval")) ok = ParsePositive(OptionValue(i, argc, argv), options.checkpoint_interval);
+    else if(!strcmp(flag, "--checkpoint")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.checkpoint = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--coordinator")) ok = ParseRange(OptionValue(i, argc, argv), 0, 65535, options.coordinator_port);
+    else if(!strcmp(flag, "--spawn-workers")) ok = ParsePositive(OptionValue(i, argc, argv), options.spawn_workers);
+    else if(!strcmp(flag, "--tile-timeout")) ok = ParsePositive(OptionValue(i, argc, argv), options.tile_timeout);
+    else if(!strcmp(flag, "--sequence")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.sequence = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--mesh")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.mesh = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--scene")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.scene = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--write-scene")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.write_scene = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--bvh-cache")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.bvh_cache = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--stats")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.stats = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--worker")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.worker = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--indirect-depth")) ok = ParseRange(OptionValue(i, argc, argv), 0, 16, options.settings.monte_carlo_depth);
+    else if(!strcmp(flag, "--indirect-rays")) ok = ParseRange(OptionValue(i, argc, argv), 0, 4096, options.settings.monte_carlo_breadth);
+    else if(!strcmp(flag, "--bounce-depth")) ok = ParseRange(OptionValue(i, argc, argv), 0, 64, options.settings.refraction_depth);
+    else if(!strcmp(flag, "--light-samples")) ok = ParseRange(OptionValue(i, argc, argv), 1, 64, options.settings.light_samples);
+    else if(!strcmp(flag, "--photons")) ok = ParseRange(OptionValue(i, argc, argv), 0, 100000000, options.settings.photon_samples);
+    else if(!strcmp(flag, "--photon-radius")) ok = ParsePositiveFloat(OptionValue(i, argc, argv), options.settings.radiance_size);
+    else if(!strcmp(flag, "--png-level")) ok = ParseRange(OptionValue(i, argc, argv), 0, 3, options.png_level);
+    else if(!strcmp(flag, "--output")) {
+      const char* value = OptionValue(i, argc, argv);
+      if(value) options.output = value;
+      ok = value != NULL;
+    }
+    else if(!strcmp(flag, "--help")) {
+      PrintUsage(argv[0]);
+      exit(0);
+    }
+    else {
+      printf("Unknown option %s\n", flag);
+      ok = false;
+    }
+
+    if(!ok) {
+      PrintUsage(argv[0]);
+      return false;
+    }
+  }
+
+  if(options.spawn_workers > 0 && options.coordinator_port < 0) {
+    printf("--spawn-workers starts workers for a coordinator, it needs --coordinator\n");
+    PrintUsage(argv[0]);
+    return false;
+  }
+  return true;
+}
+
+// render.png -> render_spp.png, the heatmap is always a png whatever the main output is
+std::string HeatmapPath(const std::string& output) {
+  size_t dot = output.find_last_of('.');
+  size_t slash = output.find_last_of('/');
+  if(dot == std::string::npos || (slash != std::string::npos && dot < slash)) return output + "_spp.png";
+  return output.substr(0, dot) + "_spp.png";
+}
+
+std::string CheckpointPath(const RenderOptions& options) {
+  return options.checkpoint.empty() ? options.output + ".checkpoint" : options.checkpoint;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef PNGSTREAM_H
+#define PNGSTREAM_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// Parallel, streaming PNG writer. The image is cut into bands of scanlines that are filtered and deflated
+// independently as soon as their rows are finished, each band ending on a byte aligned empty stored block
+// so the compressed bands simply concatenate into one zlib stream. Bands are written out in order as
+// separate IDAT chunks, which the format treats as a single stream.
+//
+// Uses lodepng's deflate and filter internals, so this must be included after lodepng.h in the same file.
+
+enum PNGCompression {
+  PNG_STORE,      // no compression, fastest
+  PNG_FAST,       // short window, no lazy matching
+  PNG_DEFAULT,    // lodepng's defaults
+  PNG_BEST,       // full 32k window
+  PNG_COMPRESSION_COUNT
+};
+
+// Uncompressed bytes per band, large enough for deflate to find its matches
+const size_t PNG_BAND_BYTES = 1 << 18;
+
+LodePNGCompressSettings CompressSettings(PNGCompression level) {
+  LodePNGCompressSettings settings;
+  lodepng_compress_settings_init(&settings);
+  if(level == PNG_FAST) {
+    settings.windowsize = 1024;
+    settings.nicematch = 32;
+    settings.lazymatching = 0;
+  } else if(level == PNG_BEST) {
+    settings.windowsize = 32768;
+    settings.nicematch = 258;
+  }
+  return settings;
+}
+
+// zlib's adler32_combine: the checksum of A followed by B from the checksums of both and B's length
+uint32_t AdlerCombine(uint32_t adler_a, uint32_t adler_b, size_t length_b) {
+  const uint64_t BASE = 65521;
+  uint64_t rem = length_b % BASE;
+  uint64_t sum1 = adler_a & 0xffff;
+  uint64_t sum2 = (rem * sum1) % BASE;
+  sum1 += (adler_b & 0xffff) + BASE - 1;
+  sum2 += ((adler_a >> 16) & 0xffff) + ((adler_b >> 16) & 0xffff) + BASE - rem;
+  sum1 %= BASE;
+  sum2 %= BASE;
+  return (uint32_t)(sum1 | (sum2 << 16));
+}
+
+// Deflates data as a run of non-final blocks followed by an empty stored block, or as the last blocks of
+// the stream if final is set. Either way the output ends byte aligned.
+unsigned DeflateBand(const uint8_t* data, size_t size, PNGCompression level, bool final, std::vector<uint8_t>& out) {
+  ucvector v;
+  ucvector_init(&v);
+  size_t bp = 0;
+  unsigned error = 0;
+
+  if(level == PNG_STORE) {
+    size_t pos = 0;
+    do {
+      size_t length = std::min(size - pos, (size_t)65535);
+      bool last = final && pos + length == size;
+      addBitsToStream(&bp, &v, last ? 1 : 0, 1);
+      addBitsToStream(&bp, &v, 0, 2);
+      uint8_t header[4] = { (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8) };
+      size_t start = v.size;
+      if(!ucvector_resize(&v, start + 4 + length)) { error = 83; break; }
+      memcpy(v.data + start, header, 4);
+      memcpy(v.data + start + 4, data + pos, length);
+      bp = v.size * 8;
+      pos += length;
+    } while(pos < size);
+  } else {
+    LodePNGCompressSettings settings = CompressSettings(level);
+    Hash hash;
+    error = hash_init(&hash, settings.windowsize);
+    const size_t block_size = 65536;
+    for(size_t start = 0; start < size && !error; start += block_size) {
+      size_t end = std::min(start + block_size, size);
+      error = deflateDynamic(&v, &bp, &hash, data, start, end, &settings, final && end == size);
+    }
+    hash_cleanup(&hash);
+
+    //Sync flush: an empty non-final stored block pads the band out to a byte boundary
+    if(!final && !error) {
+      addBitsToStream(&bp, &v, 0, 3);
+      static const uint8_t empty[4] = { 0x00, 0x00, 0xff, 0xff };
+      for(int i = 0; i < 4; i++) ucvector_push_back(&v, empty[i]);
+    }
+  }
+
+  if(!error) out.assign(v.data, v.data + v.size);
+  ucvector_cleanup(&v);
+  return error;
+}
+
+// Picks the filter with the smallest sum of absolute differences per scanline, like lodepng's default
+void FilterRow(uint8_t* out, const uint8_t* row, const uint8_t* previous, size_t length, size_t bytewidth, std::vector<uint8_t>& scratch) {
+  scratch.resize(length);
+  size_t best_sum = (size_t)-1;
+  for(unsigned char type = 0; type < 5; type++) {
+    filterScanline(scratch.data(), row, previous, length, bytewidth, type);
+    size_t sum = 0;
+    for(size_t i = 0; i < length; i++) sum += type == 0 ? scratch[i] : abs((int)(signed char)scratch[i]);
+    if(sum < best_sum) {
+      best_sum = sum;
+      out[0] = type;
+      memcpy(out + 1, scratch.data(), length);
+    }
+  }
+}
+
+// 8-bit RGBA. Rows are read from image, which must stay alive until close(); call rowDone(y) from any
+// thread once row y is final and the band it completes is encoded on that thread.
+class PNGStream {
+public:
+  PNGStream()
+    : file(NULL), image(NULL), width(0), height(0), level(PNG_DEFAULT), error(0), next_band(0)
+  {
+
+  }
+
+  ~PNGStream() {
+    if(file) fclose(file);
+  }
+
+  bool open(const std::string& path, const uint8_t* pixels, int w, int h, PNGCompression compression) {
+    image = pixels;
+    width = w;
+    height = h;
+    level = compression;
+    stride = (size_t)width * 4;
+    band_rows = std::max(1, (int)(PNG_BAND_BYTES / (stride + 1)));
+    int band_count = (height + band_rows - 1) / band_rows;
+    bands = std::vector<Band>(band_count);
+    for(int b = 0; b < band_count; b++) {
+      //A band also waits for the row above it, which its first scanline is filtered against
+      int rows = std::min(band_rows, height - (b * band_rows));
+      bands[b].pending = rows + (b > 0 ? 1 : 0);
+    }
+
+    file = fopen(path.c_str(), "wb");
+    if(!file) return false;
+
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    fwrite(signature, 1, 8, file);
+
+    uint8_t header[13];
+    lodepng_set32bitInt(header + 0, width);
+    lodepng_set32bitInt(header + 4, height);
+    header[8] = 8;    // bit depth
+    header[9] = 6;    // RGBA
+    header[10] = 0;   // deflate
+    header[11] = 0;   // adaptive filtering
+    header[12] = 0;   // no interlacing
+    writeChunk("IHDR", header, 13);
+    return !ferror(file);
+  }
+
+  void rowDone(int y) {
+    int band = y / band_rows;
+    if(--bands[band].pending == 0) encode(band);
+    if((y + 1) % band_rows == 0 && band + 1 < (int)bands.size() && --bands[band + 1].pending == 0) encode(band + 1);
+  }
+
+  // Returns 0 once every band and IEND are on disk, otherwise a lodepng error code (79 for file errors)
+  unsigned close() {
+    if(!file) return 79;
+    if(!error && next_band != (int)bands.size()) error = 79;
+    writeChunk("IEND", NULL, 0);
+    if(ferror(file) && !error) error = 79;
+    if(fclose(file) != 0 && !error) error = 79;
+    file = NULL;
+    return error;
+  }
+
+private:
+  struct Band {
+    std::atomic<int> pending;
+    bool ready;
+    uint32_t adler;
+    size_t length;
+    std::vector<uint8_t> data;
+
+    Band() : pending(0), ready(false), adler(1), length(0) {}
+    Band(const Band& other) : pending(other.pending.load()), ready(other.ready), adler(other.adler), length(other.length), data(other.data) {}
+  };
+
+  FILE* file;
+  const uint8_t* image;
+  int width;
+  int height;
+  size_t stride;
+  int band_rows;
+  PNGCompression level;
+  unsigned error;
+
+  std::vector<Band> bands;
+  std::mutex write_mutex;
+  int next_band;
+  uint32_t stream_adler;
+
+  void encode(int b) {
+    int first = b * band_rows;
+    int last = std::min(first + band_rows, height);
+
+    std::vector<uint8_t> filtered((last - first) * (stride + 1));
+    std::vector<uint8_t> scratch;
+    for(int y = first; y < last; y++) {
+      const uint8_t* previous = y > 0 ? image + ((y - 1) * stride) : NULL;
+      FilterRow(&filtered[(y - first) * (stride + 1)], image + (y * stride), previous, stride, 4, scratch);
+    }
+
+    Band& band = bands[b];
+    band.length = filtered.size();
+    band.adler = adler32(filtered.data(), (unsigned)filtered.size());
+    unsigned band_error = DeflateBand(filtered.data(), filtered.size(), level, b == (int)bands.size() - 1, band.data);
+
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if(band_error && !error) error = band_error;
+    band.ready = true;
+    flush();
+  }
+
+  //Writes every finished band that is next in line, caller holds write_mutex
+  void flush() {
+    while(next_band < (int)bands.size() && bands[next_band].ready) {
+      Band& band = bands[next_band];
+      std::vector<uint8_t> chunk;
+      if(next_band == 0) {
+        chunk.push_back(0x78);   // deflate, 32k window
+        chunk.push_back(0x01);   // no preset dictionary, check bits
+        stream_adler = band.adler;
+      } else {
+        stream_adler = AdlerCombine(stream_adler, band.adler, band.length);
+      }
+      chunk.insert(chunk.end(), band.data.begin(), band.data.end());
+      if(next_band == (int)bands.size() - 1) {
+        uint8_t adler[4];
+        lodepng_set32bitInt(adler, stream_adler);
+        chunk.insert(chunk.end(), adler, adler + 4);
+      }
+      if(!error) writeChunk("IDAT", chunk.data(), chunk.size());
+
+      std::vector<uint8_t>().swap(band.data);
+      next_band++;
+    }
+  }
+
+  void writeChunk(const char* type, const uint8_t* data, size_t length) {
+    unsigned char* chunk = NULL;
+    size_t chunk_length = 0;
+    unsigned chunk_error = lodepng_chunk_create(&chunk, &chunk_length, (unsigned)length, type, data);
+    if(chunk_error) {
+      if(!error) error = chunk_error;
+    } else {
+      fwrite(chunk, 1, chunk_length, file);
+    }
+    free(chunk);
+  }
+};
+
+#endif
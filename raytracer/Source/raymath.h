@@ -2,6 +2,7 @@
 #include <stdbool.h>
 
 #include "geometry.h"
+#include "stats.h"
 
 using namespace std;
 using glm::vec4;
@@ -66,52 +67,22 @@ vec3 myRefract(const vec3 &I, const vec3 &N, const float &ior)
   return eta * I + (eta * cosi - sqrtf(k)) * n;
 }
 
-bool solveQuadratic(const float &a, const float &b, const float &c, float &x0, float &x1)
-{
-    float discr = b * b - 4 * a * c;
-    if (discr < 0) return false;
-    else if (discr == 0) x0 = x1 = - 0.5 * b / a;
-    else {
-        float q = (b > 0) ?
-            -0.5 * (b + sqrt(discr)) :
-            -0.5 * (b - sqrt(discr));
-        x0 = q / a;
-        x1 = c / q;
-    }
-    if (x0 > x1) std::swap(x0, x1);
-
-    return true;
-}
-
-bool getIntersectionSphere (vec4 s, vec4 d, Sphere sphere, Intersection& intersection) {
-  // analytic solution
-  vec3 origin = vec3(sphere.origin);
-  vec3 L = vec3(s) - origin;
-  vec3 dir = vec3(d);
-
-  float a = dot(dir, dir);
-  float b = 2 * dot(dir, L);
-  float c = dot(L, L) - sphere.radius2;
-  float t0, t1, t;
-  if (!solveQuadratic(a, b, c, t0, t1)) return false;
-
-  if (t0 > t1) std::swap(t0, t1);
-
-  if (t0 < 0) {
-      t0 = t1; // if t0 is negative, let's use t1 instead
-      if (t0 < 0) return false; // both t0 and t1 are negative
-  }
-
-  t = t0;
-
+// Fills in the hit on sphere at distance t along the ray
+void getIntersectionSphereAt(vec4 s, vec4 d, const Sphere& sphere, float t, Intersection& intersection) {
   vec3 position = vec3(s + (d * t));
-  vec3 normal = glm::normalize(position - origin);
+  vec3 normal = glm::normalize(position - vec3(sphere.origin));
 
   intersection.position = vec4(position, 1);
   intersection.normal = vec4(normal, 1);
   intersection.distance = t;
   intersection.properties = sphere.properties;
+}
 
+bool getIntersectionSphere (vec4 s, vec4 d, const Sphere& sphere, Intersection& intersection) {
+  vec3 dir = vec3(d);
+  float t = SphereDistance(vec3(s), dir, dot(dir, dir), sphere.origin.x, sphere.origin.y, sphere.origin.z, sphere.radius2);
+  if (t < 0) return false;
+  getIntersectionSphereAt(s, d, sphere, t, intersection);
   return true;
 }
 
@@ -154,11 +125,254 @@ bool getIntersectionTriangle(vec4 s, vec4 d, Triangle triangle, Intersection& in
   return false;
 }
 
+// Ray distance to a mesh face and the barycentric coordinates of the hit, negative on a miss. The same test as
+// getIntersectionTriangle, position, normal and material are left to the caller so only the closest face pays.
+float getDistanceMeshFace(vec4 s, vec4 d, const Mesh& mesh, size_t face, float& u_coord, float& v_coord) {
+  const uint32_t* corners = &mesh.indices[face * 3];
+  vec3 v0 = mesh.positions[corners[0]];
+  vec3 e1 = mesh.positions[corners[1]] - v0;
+  vec3 e2 = mesh.positions[corners[2]] - v0;
+  vec3 b = vec3(s) - v0;
+  mat3 A( -vec3(d), e1, e2 );
+
+  float detA = glm::determinant(A);
+  float detA1 = glm::determinant(mat3(b, A[1], A[2]));
+  float detA2 = glm::determinant(mat3(A[0], b, A[2]));
+  float detA3 = glm::determinant(mat3(A[0], A[1], b));
+  vec3 x = vec3(detA1, detA2, detA3) / detA; //Cramers Rule
+
+  u_coord = x.y;
+  v_coord = x.z;
+  if(x.x > 0 && u_coord > 0 && v_coord > 0 && (u_coord + v_coord) < 1) return x.x;
+  return -1;
+}
+
+void getIntersectionMeshFace(const Scene &scene, size_t face, float distance, float u_coord, float v_coord, Intersection& intersection) {
+  const Mesh& mesh = scene.scene_mesh;
+  const uint32_t* corners = &mesh.indices[face * 3];
+  vec3 v0 = mesh.positions[corners[0]];
+  vec3 e1 = mesh.positions[corners[1]] - v0;
+  vec3 e2 = mesh.positions[corners[2]] - v0;
+
+  intersection.position = vec4(v0 + (u_coord * e1) + (v_coord * e2), 1.0);
+  intersection.normal = vec4(mesh.faceNormal(face), 1.0);
+  intersection.distance = distance;
+  intersection.properties = scene.scene_materials[mesh.materials[face]];
+}
+
+// Slab test, the distance the ray enters the node's box at or a negative value if it misses it or only
+// reaches it beyond limit (a negative limit means no limit)
+inline float getDistanceBox(const BVHNode& node, const vec3& origin, const vec3& inverse, float limit) {
+  float near = 0, far = limit < 0 ? 1e30f : limit;
+  for(int axis = 0; axis < 3; axis++) {
+    float t0 = (node.low[axis] - origin[axis]) * inverse[axis];
+    float t1 = (node.high[axis] - origin[axis]) * inverse[axis];
+    near = std::max(near, std::min(t0, t1));
+    far = std::min(far, std::max(t0, t1));
+  }
+  return near <= far ? near : -1;
+}
+
+// Walks the BVH nearest child first, calling leaf(node) for every leaf whose box the ray enters no further
+// than closest (no limit while it is negative). leaf may lower closest to prune the rest.
+template <typename Leaf>
+void TraverseLeaves(const BVH& bvh, vec4 s, vec4 d, float& closest, Leaf leaf) {
+  vec3 origin = vec3(s);
+  vec3 inverse = vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+
+  uint32_t stack[BVH_MAX_DEPTH * 2];
+  int top = 0;
+  uint64_t visits = 0, tests = 0;
+  if(getDistanceBox(bvh.nodes[0], origin, inverse, closest) >= 0) stack[top++] = 0;
+  while(top > 0) {
+    const BVHNode& node = bvh.nodes[stack[--top]];
+    visits++;
+    if(node.count > 0) {
+      tests += node.count;
+      leaf(node);
+      continue;
+    }
+
+    //Nearer child on top of the stack so it is searched first and tightens the limit for the other
+    uint32_t left = (uint32_t)(&node - &bvh.nodes[0]) + 1;
+    uint32_t right = node.first;
+    float left_distance = getDistanceBox(bvh.nodes[left], origin, inverse, closest);
+    float right_distance = getDistanceBox(bvh.nodes[right], origin, inverse, closest);
+    if(left_distance >= 0 && right_distance >= 0) {
+      bool left_first = left_distance <= right_distance;
+      stack[top++] = left_first ? right : left;
+      stack[top++] = left_first ? left : right;
+    } else if(left_distance >= 0) {
+      stack[top++] = left;
+    } else if(right_distance >= 0) {
+      stack[top++] = right;
+    }
+  }
+  CountStat(STAT_NODE_VISITS, visits);
+  CountStat(STAT_PRIMITIVE_TESTS, tests);
+}
+
+// As TraverseLeaves for every primitive in the leaves
+template <typename Primitive>
+void TraverseClosest(const BVH& bvh, vec4 s, vec4 d, float& closest, Primitive primitive) {
+  TraverseLeaves(bvh, s, d, closest, [&](const BVHNode& node) {
+    for(uint32_t i = node.first; i < node.first + node.count; i++) primitive(bvh.primitives[i]);
+  });
+}
+
+// True as soon as leaf(node) returns true for any leaf the ray passes through
+template <typename Leaf>
+bool TraverseAnyLeaf(const BVH& bvh, vec4 s, vec4 d, Leaf leaf) {
+  vec3 origin = vec3(s);
+  vec3 inverse = vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+  uint32_t stack[BVH_MAX_DEPTH * 2];
+  int top = 0;
+  uint64_t visits = 0, tests = 0;
+  bool found = false;
+  stack[top++] = 0;
+  while(top > 0 && !found) {
+    uint32_t index = stack[--top];
+    const BVHNode& node = bvh.nodes[index];
+    visits++;
+    if(getDistanceBox(node, origin, inverse, -1) < 0) continue;
+    if(node.count > 0) {
+      tests += node.count;
+      found = leaf(node);
+      continue;
+    }
+    stack[top++] = node.first;
+    stack[top++] = index + 1;
+  }
+  CountStat(STAT_NODE_VISITS, visits);
+  CountStat(STAT_PRIMITIVE_TESTS, tests);
+  return found;
+}
+
+// True as soon as primitive(index) returns true for a primitive the ray might hit
+template <typename Primitive>
+bool TraverseAny(const BVH& bvh, vec4 s, vec4 d, Primitive primitive) {
+  return TraverseAnyLeaf(bvh, s, d, [&](const BVHNode& node) {
+    for(uint32_t i = node.first; i < node.first + node.count; i++) {
+      if(primitive(bvh.primitives[i])) return true;
+    }
+    return false;
+  });
+}
+
+// Sphere hits go through scene_sphere_pack once UpdateSphereBVH has laid it out for the current spheres
+inline bool SphereBVHReady(const Scene& scene) {
+  return !scene.scene_sphere_bvh.empty() && scene.scene_sphere_bvh.info.primitive_count == scene.scene_spheres.size() &&
+         scene.scene_sphere_pack.ids.size() == scene.scene_spheres.size() + SPHERE_LANES;
+}
+
+// Closest mesh face through the BVH that is nearer than closest, or -1. Equal distances go to the lower face
+// index, as in a plain loop over the faces, so the result does not depend on the tree.
+long int ClosestMeshFace(vec4 s, vec4 d, const Mesh& mesh, const BVH& bvh, float& closest, float& closest_u, float& closest_v) {
+  long int closest_face = -1;
+  TraverseClosest(bvh, s, d, closest, [&](uint32_t face) {
+    float u_coord, v_coord;
+    float distance = getDistanceMeshFace(s, d, mesh, face, u_coord, v_coord);
+    if(distance > 0 && (closest < 0 || distance < closest || (distance == closest && (long int)face < closest_face))) {
+      closest = distance;
+      closest_face = face;
+      closest_u = u_coord;
+      closest_v = v_coord;
+    }
+  });
+  return closest_face;
+}
+
+bool AnyMeshFace(vec4 s, vec4 d, const Mesh& mesh, const BVH& bvh) {
+  return TraverseAny(bvh, s, d, [&](uint32_t face) {
+    float u_coord, v_coord;
+    return getDistanceMeshFace(s, d, mesh, face, u_coord, v_coord) > 0;
+  });
+}
+
+// The ray in the object space of an instance
+inline void ToObject(const Instance& instance, vec4 s, vec4 d, vec4& object_s, vec4& object_d) {
+  object_s = vec4(TransformPoint(instance.to_object, vec3(s)), 1.0f);
+  object_d = vec4(TransformDirection(instance.to_object, vec3(d)), 0.0f);
+}
+
+// Closest face of any instance nearer than closest, returns the instance or -1 and sets face and coordinates
+long int ClosestInstanceFace(vec4 s, vec4 d, const Scene& scene, float& closest, long int& closest_face, float& closest_u, float& closest_v) {
+  long int closest_instance = -1;
+  TraverseClosest(scene.scene_instance_bvh, s, d, closest, [&](uint32_t index) {
+    const Instance& instance = scene.scene_instances[index];
+    const Prototype& prototype = scene.scene_prototypes[instance.prototype];
+    if(prototype.bvh.empty()) return;
+    vec4 object_s, object_d;
+    ToObject(instance, s, d, object_s, object_d);
+    long int face = ClosestMeshFace(object_s, object_d, prototype.mesh, prototype.bvh, closest, closest_u, closest_v);
+    if(face >= 0) {
+      closest_instance = index;
+      closest_face = face;
+    }
+  });
+  return closest_instance;
+}
+
+bool AnyInstanceFace(vec4 s, vec4 d, const Scene& scene) {
+  return TraverseAny(scene.scene_instance_bvh, s, d, [&](uint32_t index) {
+    const Instance& instance = scene.scene_instances[index];
+    const Prototype& prototype = scene.scene_prototypes[instance.prototype];
+    if(prototype.bvh.empty()) return false;
+    vec4 object_s, object_d;
+    ToObject(instance, s, d, object_s, object_d);
+    return AnyMeshFace(object_s, object_d, prototype.mesh, prototype.bvh);
+  });
+}
+
+void getIntersectionInstanceFace(const Scene &scene, size_t index, size_t face, float distance, float u_coord, float v_coord, Intersection& intersection) {
+  const Instance& instance = scene.scene_instances[index];
+  const Mesh& mesh = scene.scene_prototypes[instance.prototype].mesh;
+  const uint32_t* corners = &mesh.indices[face * 3];
+  vec3 v0 = mesh.positions[corners[0]];
+  vec3 e1 = mesh.positions[corners[1]] - v0;
+  vec3 e2 = mesh.positions[corners[2]] - v0;
+
+  intersection.position = vec4(TransformPoint(instance.to_world, v0 + (u_coord * e1) + (v_coord * e2)), 1.0);
+  intersection.normal = vec4(TransformNormal(instance, mesh.faceNormal(face)), 1.0);
+  intersection.distance = distance;
+  intersection.properties = scene.scene_materials[mesh.materials[face]];
+}
+
 bool ClosestIntersection(vec4 s, vec4 d, Scene &scene, Intersection& closestIntersection) {
 
 
   closestIntersection.distance = -1;
 
+  const Mesh& mesh = scene.scene_mesh;
+  long int closest_face = -1;
+  float closest_u = 0, closest_v = 0;
+  if(scene.scene_bvh.covers(mesh)) {
+    closest_face = ClosestMeshFace(s, d, mesh, scene.scene_bvh, closestIntersection.distance, closest_u, closest_v);
+  } else {
+    CountStat(STAT_PRIMITIVE_TESTS, mesh.faceCount());
+    for (size_t i = 0; i < mesh.faceCount(); i++){
+      float u_coord, v_coord;
+      float distance = getDistanceMeshFace(s, d, mesh, i, u_coord, v_coord);
+      if(distance > 0 && (closestIntersection.distance < 0 || distance < closestIntersection.distance)) {
+        closestIntersection.distance = distance;
+        closest_face = i;
+        closest_u = u_coord;
+        closest_v = v_coord;
+      }
+    }
+  }
+  //Instances only win with strictly closer hits, ties stay with the world mesh
+  long int closest_instance = -1;
+  if(!scene.scene_instance_bvh.empty()) {
+    closest_instance = ClosestInstanceFace(s, d, scene, closestIntersection.distance, closest_face, closest_u, closest_v);
+  }
+  if(closest_instance >= 0) {
+    getIntersectionInstanceFace(scene, closest_instance, closest_face, closestIntersection.distance, closest_u, closest_v, closestIntersection);
+  } else if(closest_face >= 0) {
+    getIntersectionMeshFace(scene, closest_face, closestIntersection.distance, closest_u, closest_v, closestIntersection);
+  }
+
+  CountStat(STAT_PRIMITIVE_TESTS, scene.scene_triangles.size());
   for (long unsigned int i = 0; i < scene.scene_triangles.size(); i++){
 
     Intersection intersection;
@@ -170,10 +384,24 @@ bool ClosestIntersection(vec4 s, vec4 d, Scene &scene, Intersection& closestInte
     }
   }
 
+  if(SphereBVHReady(scene)) {
+    //Whole leaves are tested at once from the packed spheres, only the winner gets its hit filled in. Same
+    //winner as the loop below: equal distances stay with what was hit first, or the lower sphere index.
+    long int closest_sphere = -1;
+    float distance = closestIntersection.distance;
+    vec3 origin = vec3(s), direction = vec3(d);
+    TraverseLeaves(scene.scene_sphere_bvh, s, d, distance, [&](const BVHNode& leaf) {
+      scene.scene_sphere_pack.closestIn(origin, direction, leaf.first, leaf.count, distance, closest_sphere);
+    });
+    if(closest_sphere >= 0) getIntersectionSphereAt(s, d, scene.scene_spheres[closest_sphere], distance, closestIntersection);
+    return (closestIntersection.distance > 0);
+  }
+
+  CountStat(STAT_PRIMITIVE_TESTS, scene.scene_spheres.size());
   for (long unsigned int i = 0; i < scene.scene_spheres.size(); i++){
 
     Intersection intersection;
-    Sphere sphere = scene.scene_spheres[i];
+    const Sphere& sphere = scene.scene_spheres[i];
     if(getIntersectionSphere(s, d, sphere, intersection)) {
       if((closestIntersection.distance < 0 || intersection.distance < closestIntersection.distance)) {
         closestIntersection = intersection;
@@ -185,6 +413,19 @@ bool ClosestIntersection(vec4 s, vec4 d, Scene &scene, Intersection& closestInte
 }
 
 bool anIntersection(vec4 s, vec4 d, Scene &scene, Intersection& closestIntersection) {
+  if(!scene.scene_instance_bvh.empty() && AnyInstanceFace(s, d, scene)) return true;
+
+  if(scene.scene_bvh.covers(scene.scene_mesh)) {
+    if(AnyMeshFace(s, d, scene.scene_mesh, scene.scene_bvh)) return true;
+  } else {
+    for (size_t i = 0; i < scene.scene_mesh.faceCount(); i++){
+      float u_coord, v_coord;
+      if(getDistanceMeshFace(s, d, scene.scene_mesh, i, u_coord, v_coord) > 0) {
+        return true;
+      }
+    }
+  }
+
   for (long unsigned int i = 0; i < scene.scene_triangles.size(); i++){
 
     Intersection intersection;
@@ -194,10 +435,17 @@ bool anIntersection(vec4 s, vec4 d, Scene &scene, Intersection& closestIntersect
     }
   }
 
+  if(SphereBVHReady(scene)) {
+    vec3 origin = vec3(s), direction = vec3(d);
+    return TraverseAnyLeaf(scene.scene_sphere_bvh, s, d, [&](const BVHNode& leaf) {
+      return scene.scene_sphere_pack.anyIn(origin, direction, leaf.first, leaf.count);
+    });
+  }
+
   for (long unsigned int i = 0; i < scene.scene_spheres.size(); i++){
 
     Intersection intersection;
-    Sphere sphere = scene.scene_spheres[i];
+    const Sphere& sphere = scene.scene_spheres[i];
     if(getIntersectionSphere(s, d, sphere, intersection)) {
       return true;
     }
@@ -0,0 +1,99 @@
+#ifndef REPROJECTION_H
+#define REPROJECTION_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <math.h>
+#include "framebuffer.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+// Pixels whose primary hit moves less than this fraction of its distance to the camera are kept
+const float REPROJECTION_TOLERANCE = 0.01f;
+// Reused estimates are weighted as at most this many samples so the new view can still refine them
+const int REPROJECTION_HISTORY = 16;
+
+// World position of each pixel's primary hit, recorded alongside the framebuffer estimate
+class ReprojectionCache {
+public:
+  int width;
+  int height;
+  std::vector<vec4> positions; // w = 0 where nothing is cached
+
+  ReprojectionCache(int width, int height)
+    : width(width), height(height), positions(width * height, vec4(0, 0, 0, 0))
+  {
+
+  }
+
+  void clear() {
+    std::fill(positions.begin(), positions.end(), vec4(0, 0, 0, 0));
+  }
+};
+
+// Inverse of the primary ray setup in SamplePixel, false if the point is behind the camera or off screen
+bool ProjectToPixel(vec4 position, vec4 cameraPos, const mat4& rotation, float focal, int width, int height, int& x, int& y, float& depth) {
+  vec3 local = vec3(glm::transpose(rotation) * vec4(vec3(position - cameraPos), 0));
+  if(local.z <= 0) return false;
+
+  float aspect_ratio = ((float)height) / ((float)width);
+  float xDir = (local.x * focal) / local.z;
+  float yDir = ((local.y * focal) / local.z) / aspect_ratio;
+
+  x = (int)floorf((xDir + 1) * width * 0.5f);
+  y = (int)floorf((yDir + 1) * height * 0.5f);
+  depth = local.z;
+  return x >= 0 && x < width && y >= 0 && y < height;
+}
+
+// Moves every cached estimate to where its surface lands in the new view. Each landing pixel is
+// checked with a primary ray through trace(x, y, hit); estimates that fail the check are dropped,
+// leaving samples == 0 for the renderer to fill. Returns the fraction of pixels that were kept.
+template <typename PrimaryTrace>
+float Reproject(Framebuffer& framebuffer, ReprojectionCache& cache, vec4 cameraPos, const mat4& rotation, float focal, PrimaryTrace trace) {
+  const int count = framebuffer.width * framebuffer.height;
+  std::vector<int> source(count, -1);
+  std::vector<float> nearest(count, INFINITY);
+
+  for(int i = 0; i < count; i++) {
+    if(cache.positions[i].w == 0 || framebuffer.pixels[i].samples == 0) continue;
+    int x, y;
+    float depth;
+    if(!ProjectToPixel(cache.positions[i], cameraPos, rotation, focal, framebuffer.width, framebuffer.height, x, y, depth)) continue;
+    int target = (y * framebuffer.width) + x;
+    if(depth < nearest[target]) {
+      nearest[target] = depth;
+      source[target] = i;
+    }
+  }
+
+  std::vector<PixelStats> pixels(count);
+  std::vector<vec4> positions(count, vec4(0, 0, 0, 0));
+  int kept = 0;
+
+  #pragma omp parallel for schedule(dynamic) reduction(+:kept)
+  for(int y = 0; y < framebuffer.height; y++) {
+    for(int x = 0; x < framebuffer.width; x++) {
+      int target = (y * framebuffer.width) + x;
+      if(source[target] < 0) continue;
+
+      vec4 hit;
+      if(!trace(x, y, hit)) continue;
+      vec4 cached = cache.positions[source[target]];
+      if(glm::distance(vec3(hit), vec3(cached)) > REPROJECTION_TOLERANCE * glm::distance(vec3(hit), vec3(cameraPos))) continue;
+
+      pixels[target] = framebuffer.pixels[source[target]];
+      pixels[target].capHistory(REPROJECTION_HISTORY);
+      positions[target] = hit;
+      kept++;
+    }
+  }
+
+  framebuffer.pixels.swap(pixels);
+  cache.positions.swap(positions);
+  return ((float)kept) / ((float)count);
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+// Samplers are indexed by pixel, sample index and dimension so that every value is reproducible
+// regardless of which thread draws it. The shaders pull dimensions one at a time through NextSample().
+
+enum SamplerType {
+  SAMPLER_RANDOM,
+  SAMPLER_SOBOL,
+  SAMPLER_BLUE_NOISE,
+  SAMPLER_COUNT
+};
+
+const char* SAMPLER_NAMES[SAMPLER_COUNT] = { "random", "sobol", "blue-noise" };
+
+uint32_t MixBits(uint32_t v) {
+  v ^= v >> 16;
+  v *= 0x7feb352dU;
+  v ^= v >> 15;
+  v *= 0x846ca68bU;
+  v ^= v >> 16;
+  return v;
+}
+
+uint32_t HashCombine(uint32_t seed, uint32_t v) {
+  return MixBits(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+uint32_t ReverseBits(uint32_t v) {
+  v = ((v >> 1) & 0x55555555U) | ((v & 0x55555555U) << 1);
+  v = ((v >> 2) & 0x33333333U) | ((v & 0x33333333U) << 2);
+  v = ((v >> 4) & 0x0f0f0f0fU) | ((v & 0x0f0f0f0fU) << 4);
+  v = ((v >> 8) & 0x00ff00ffU) | ((v & 0x00ff00ffU) << 8);
+  return (v >> 16) | (v << 16);
+}
+
+float ToUnitFloat(uint32_t v) {
+  return (v >> 8) * (1.0f / 16777216.0f);
+}
+
+class Sampler {
+public:
+  virtual ~Sampler() {}
+  virtual float get(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) = 0;
+};
+
+// White noise, kept as the reference the other samplers are compared against
+class RandomSampler : public Sampler {
+public:
+  float get(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) {
+    uint32_t h = HashCombine(HashCombine(HashCombine(MixBits(x), y), index), dimension);
+    return ToUnitFloat(h);
+  }
+};
+
+// Owen scrambled, shuffled Sobol (0,2) sequence padded across dimension pairs (Burley 2020)
+class SobolSampler : public Sampler {
+public:
+  float get(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) {
+    uint32_t pair_seed = HashCombine(HashCombine(MixBits(x), y), dimension / 2);
+    uint32_t shuffled = NestedUniformScramble(index, pair_seed);
+    uint32_t value = (dimension & 1) ? SobolSecond(shuffled) : ReverseBits(shuffled);
+    return ToUnitFloat(NestedUniformScramble(value, HashCombine(pair_seed, dimension & 1)));
+  }
+
+private:
+  static uint32_t SobolSecond(uint32_t index) {
+    uint32_t result = 0;
+    for(uint32_t v = 1U << 31; index; index >>= 1, v ^= v >> 1) {
+      if(index & 1) result ^= v;
+    }
+    return result;
+  }
+
+  static uint32_t LaineKarrasPermutation(uint32_t v, uint32_t seed) {
+    v += seed;
+    v ^= v * 0x6c50b47cU;
+    v ^= v * 0xb82f1e52U;
+    v ^= v * 0xc7afe638U;
+    v ^= v * 0x8d22f6e6U;
+    return v;
+  }
+
+  static uint32_t NestedUniformScramble(uint32_t v, uint32_t seed) {
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(v), seed));
+  }
+};
+
+// Void-and-cluster blue noise mask, shifted per dimension and advanced per sample by the golden ratio
+class BlueNoiseSampler : public Sampler {
+public:
+  static const int SIZE = 64;
+
+  BlueNoiseSampler() {
+    GenerateMask();
+  }
+
+  float get(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension) {
+    uint32_t offset = MixBits(dimension + 1);
+    int mx = (x + (offset & 0xffff)) % SIZE;
+    int my = (y + (offset >> 16)) % SIZE;
+    //Golden ratio steps in 0.32 fixed point, a float product keeps too few fractional bits past a few thousand
+    uint32_t step = index * 2654435769u;
+    float value = mask[(my * SIZE) + mx] + ((float)(step >> 8) * (1.0f / 16777216.0f));
+    return value - floorf(value);
+  }
+
+private:
+  std::vector<float> mask;
+
+  static float Kernel(int dx, int dy) {
+    dx = std::min(abs(dx), SIZE - abs(dx));
+    dy = std::min(abs(dy), SIZE - abs(dy));
+    const float sigma = 1.5f;
+    return expf(-((float)(dx * dx + dy * dy)) / (2 * sigma * sigma));
+  }
+
+  void GenerateMask() {
+    const int count = SIZE * SIZE;
+    std::vector<float> kernel(count);
+    for(int y = 0; y < SIZE; y++) {
+      for(int x = 0; x < SIZE; x++) kernel[(y * SIZE) + x] = Kernel(x, y);
+    }
+
+    std::vector<char> pattern(count, 0);
+    std::vector<float> energy(count, 0);
+
+    auto splat = [&](std::vector<float>& target, int p, float sign) {
+      int px = p % SIZE, py = p / SIZE;
+      for(int y = 0; y < SIZE; y++) {
+        const float* row = &kernel[((y - py + SIZE) % SIZE) * SIZE];
+        for(int x = 0; x < SIZE; x++) target[(y * SIZE) + x] += sign * row[(x - px + SIZE) % SIZE];
+      }
+    };
+    auto extreme = [&](const std::vector<float>& values, char wanted, bool largest) {
+      int best = -1;
+      for(int p = 0; p < count; p++) {
+        if(pattern[p] != wanted) continue;
+        if(best < 0 || (largest ? values[p] > values[best] : values[p] < values[best])) best = p;
+      }
+      return best;
+    };
+
+    //Initial binary pattern, relaxed by moving the tightest cluster into the largest void
+    int ones = count / 10;
+    for(int i = 0; i < ones; i++) {
+      int p = MixBits(i + 1) % count;
+      while(pattern[p]) p = (p + 1) % count;
+      pattern[p] = 1;
+      splat(energy, p, 1);
+    }
+    for(int i = 0; i < count; i++) {
+      int cluster = extreme(energy, 1, true);
+      pattern[cluster] = 0;
+      splat(energy, cluster, -1);
+      int gap = extreme(energy, 0, false);
+      pattern[gap] = 1;
+      splat(energy, gap, 1);
+      if(gap == cluster) break;
+    }
+
+    std::vector<int> rank(count, 0);
+    std::vector<char> initial = pattern;
+    std::vector<float> initial_energy = energy;
+
+    //Rank the initial points by repeatedly removing the tightest cluster
+    for(int r = ones - 1; r >= 0; r--) {
+      int cluster = extreme(energy, 1, true);
+      pattern[cluster] = 0;
+      splat(energy, cluster, -1);
+      rank[cluster] = r;
+    }
+
+    //Fill the largest voids up to half coverage
+    pattern = initial;
+    energy = initial_energy;
+    int r = ones;
+    for(; r < count / 2; r++) {
+      int gap = extreme(energy, 0, false);
+      pattern[gap] = 1;
+      splat(energy, gap, 1);
+      rank[gap] = r;
+    }
+
+    //Past half, the remaining zeros are the minority, so fill their tightest clusters
+    std::fill(energy.begin(), energy.end(), 0.f);
+    for(int p = 0; p < count; p++) {
+      if(!pattern[p]) splat(energy, p, 1);
+    }
+    for(; r < count; r++) {
+      int cluster = extreme(energy, 0, true);
+      pattern[cluster] = 1;
+      splat(energy, cluster, -1);
+      rank[cluster] = r;
+    }
+
+    mask.resize(count);
+    for(int p = 0; p < count; p++) mask[p] = (rank[p] + 0.5f) / count;
+  }
+};
+
+// Where the current thread is in its sample stream
+struct SampleState {
+  uint32_t x;
+  uint32_t y;
+  uint32_t index;
+  uint32_t dimension;
+};
+
+thread_local SampleState sample_state = { 0, 0, 0, 0 };
+Sampler* samplers[SAMPLER_COUNT] = { NULL, NULL, NULL };
+SamplerType sampler_type = SAMPLER_SOBOL;
+
+void SetSampler(SamplerType type) {
+  if(!samplers[type]) {
+    if(type == SAMPLER_RANDOM) samplers[type] = new RandomSampler();
+    if(type == SAMPLER_SOBOL) samplers[type] = new SobolSampler();
+    if(type == SAMPLER_BLUE_NOISE) samplers[type] = new BlueNoiseSampler();
+  }
+  sampler_type = type;
+}
+
+void StartSample(uint32_t x, uint32_t y, uint32_t index) {
+  sample_state.x = x;
+  sample_state.y = y;
+  sample_state.index = index;
+  sample_state.dimension = 0;
+}
+
+// SetSampler must have been called for the active type before rendering starts
+float NextSample() {
+  float value = samplers[sampler_type]->get(sample_state.x, sample_state.y, sample_state.index, sample_state.dimension);
+  sample_state.dimension++;
+  return value;
+}
+
+// Passes over dimensions a shader has no use for, so the ones drawn after them stay the same
+void SkipSamples(uint32_t count) {
+  sample_state.dimension += count;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef SCENEDESC_H
+#define SCENEDESC_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "TestModelH.h"
+#include "objloader.h"
+#include "options.h"
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+// Text scene descriptions, parsed at startup so scene variants need no rebuild. One entry per line, # starts a
+// comment, and everything after the first word except the positional values of sphere, triangle, mesh and
+// camera is given as key value pairs in any order, with defaults for whatever is left out:
+//
+//   cornell                                         the built in Cornell box
+//   material <name> color r g b ambient a diffuse d specular s shininess n reflectance r refractance t ior i
+//   sphere <x> <y> <z> <radius> <material>
+//   triangle <material> <x y z> <x y z> <x y z>
+//   mesh <file.obj> <material> [at x y z] [size s]  stood on (x, y, z), largest side s, path relative to this file
+//   object <name> <file.obj> <material>             a mesh loaded once and only placed by instance entries
+//   instance <object> [at x y z] [scale s] [rotate degrees]   a copy stood on (x, y, z), turned about y
+//   light position x y z color r g b ambient a diffuse d specular s attenuation constant linear quadratic size s
+//   camera <x> <y> <z> [yaw pitch roll]
+//   settings <option> [value]                       a command line option without the dashes, e.g. width 1920
+//
+// Materials and objects have to be defined before they are used. Objects are scaled to a largest side of 1
+// before an instance's scale. Settings are defaults, the command line overrides them.
+
+// The scene rendered without --scene. Scenes/cornell.scene is the same scene as a file, change both together,
+// make check-scenes tells if they differ.
+const char* DEFAULT_SCENE =
+  "cornell\n"
+  "material glass color 1 1 1 ambient 0.01 shininess 8 refractance 1 ior 1.5\n"
+  "material mirror color 1 1 1 ambient 0.1 diffuse 0.1 specular 1 shininess 10 reflectance 0.9\n"
+  "sphere 0 0 -0.7 0.2 glass\n"
+  "sphere 0.4 -0.2 0 0.15 mirror\n"
+  "light position 0 -0.5 -0.7 color 1 1 1 ambient 0.1 diffuse 14 specular 14 attenuation 0 0 12.5 size 0.1\n";
+
+struct MeshReference {
+  std::string path;
+  ShaderProperties properties;
+  vec3 base;
+  float size;
+};
+
+struct ObjectReference {
+  std::string path;
+  ShaderProperties properties;
+};
+
+struct InstanceReference {
+  uint32_t object;
+  vec3 base;
+  float scale;
+  float rotation;   // degrees about y
+};
+
+class SceneDescription {
+public:
+  bool cornell;
+  std::vector<Sphere> spheres;
+  std::vector<Triangle> triangles;
+  std::vector<PointLight> lights;
+  std::vector<MeshReference> meshes;
+  std::vector<ObjectReference> objects;
+  std::vector<InstanceReference> instances;
+  bool has_camera;
+  vec3 camera_position;
+  vec3 camera_rotation;               // yaw, pitch, roll
+  std::vector<std::string> settings;  // as command line arguments
+
+  SceneDescription() : cornell(false), has_camera(false) {}
+
+  bool load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file) {
+      printf("Cannot open scene %s\n", path.c_str());
+      return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t read;
+    while((read = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, read);
+    fclose(file);
+
+    size_t slash = path.find_last_of('/');
+    directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    return parse(text, path);
+  }
+
+  bool parse(const std::string& text, const std::string& name) {
+    size_t start = 0;
+    int number = 0;
+    while(start < text.size()) {
+      size_t end = text.find('\n', start);
+      if(end == std::string::npos) end = text.size();
+      std::string line = text.substr(start, end - start);
+      start = end + 1;
+      number++;
+
+      size_t comment = line.find('#');
+      if(comment != std::string::npos) line.erase(comment);
+      Tokens tokens(line);
+      if(tokens.done()) continue;
+
+      std::string error = parseLine(tokens);
+      if(error.empty() && !tokens.done()) error = "unexpected '" + tokens.next() + "'";
+      if(!error.empty()) {
+        printf("%s:%d: %s\n", name.c_str(), number, error.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Applies settings to options, true if they were all valid options
+  bool applySettings(RenderOptions& options) const {
+    std::vector<char*> args;
+    args.push_back((char*)"scene");
+    for(size_t i = 0; i < settings.size(); i++) args.push_back((char*)settings[i].c_str());
+    return ParseOptions(args.size(), args.data(), options);
+  }
+
+  // Adds everything described to scene, false if a mesh failed to load
+  bool build(Scene& scene, vec4& camera, vec3& rotation) const {
+    if(cornell) {
+      vector<Triangle> box;
+      LoadTestModel(box);
+      AddTriangles(scene, box);
+
+      //The camera looks at the middle of the box unless told otherwise
+      vec4 sum = vec4(0, 0, 0, 0);
+      for (int i = 0; i < (int)box.size(); i++) {
+        sum += ((box[i].v0 + box[i].v1 + box[i].v2) / 3.0f);
+      }
+      vec4 center = sum / ((float)box.size());
+      camera.x = center.x;
+      camera.y = center.y;
+    }
+    AddTriangles(scene, triangles);
+    scene.scene_spheres.insert(scene.scene_spheres.end(), spheres.begin(), spheres.end());
+    scene.scene_lights.insert(scene.scene_lights.end(), lights.begin(), lights.end());
+
+    for(size_t i = 0; i < meshes.size(); i++) {
+      const MeshReference& reference = meshes[i];
+      size_t first_vertex = scene.scene_mesh.positions.size();
+      scene.scene_materials.push_back(reference.properties);
+      if(!LoadOBJ(reference.path, scene.scene_mesh, scene.scene_materials.size() - 1)) return false;
+      PlaceMesh(scene.scene_mesh, first_vertex, reference.base, reference.size);
+    }
+
+    size_t first_prototype = scene.scene_prototypes.size();
+    for(size_t i = 0; i < objects.size(); i++) {
+      scene.scene_prototypes.push_back(Prototype());
+      Mesh& mesh = scene.scene_prototypes.back().mesh;
+      scene.scene_materials.push_back(objects[i].properties);
+      if(!LoadOBJ(objects[i].path, mesh, scene.scene_materials.size() - 1)) return false;
+      PlaceMesh(mesh, 0, vec3(0, 0, 0), 1.0f);
+    }
+    for(size_t i = 0; i < instances.size(); i++) {
+      const InstanceReference& reference = instances[i];
+      float angle = reference.rotation * (3.14159265f / 180.0f);
+      float c = cosf(angle) * reference.scale, s = sinf(angle) * reference.scale;
+      //glm is column major: translate * rotate about y * scale
+      mat4 to_world(vec4(c, 0, -s, 0), vec4(0, reference.scale, 0, 0), vec4(s, 0, c, 0), vec4(reference.base, 1));
+      scene.scene_instances.push_back(MakeInstance(first_prototype + reference.object, to_world));
+    }
+
+    if(has_camera) {
+      camera = vec4(camera_position, 1.0f);
+      rotation = camera_rotation;
+    }
+    return true;
+  }
+
+private:
+  std::string directory;
+  std::map<std::string, ShaderProperties> materials;
+  std::map<std::string, uint32_t> object_names;
+
+  // Whitespace separated words of one line
+  class Tokens {
+  public:
+    explicit Tokens(const std::string& line) : position(0) {
+      size_t start = line.find_first_not_of(" \t\r");
+      while(start != std::string::npos) {
+        size_t end = line.find_first_of(" \t\r", start);
+        words.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        start = end == std::string::npos ? end : line.find_first_not_of(" \t\r", end);
+      }
+    }
+
+    bool done() const { return position >= words.size(); }
+    std::string next() { return done() ? "" : words[position++]; }
+
+    bool number(float& value) {
+      if(done()) return false;
+      const char* word = words[position].c_str();
+      char* end;
+      value = strtof(word, &end);
+      if(end == word || *end != '\0') return false;
+      position++;
+      return true;
+    }
+
+    bool vector(vec3& value) {
+      return number(value.x) && number(value.y) && number(value.z);
+    }
+
+  private:
+    std::vector<std::string> words;
+    size_t position;
+  };
+
+  //Returns an error message, empty if the line was fine
+  std::string parseLine(Tokens& tokens) {
+    std::string kind = tokens.next();
+
+    if(kind == "cornell") {
+      cornell = true;
+    } else if(kind == "material") {
+      std::string name = tokens.next();
+      if(name.empty()) return "material needs a name";
+      ShaderProperties properties(vec3(0.75f, 0.75f, 0.75f), 0, 0, 0, 1, 0, 0, 1);
+      while(!tokens.done()) {
+        std::string key = tokens.next();
+        bool ok;
+        if(key == "color") ok = tokens.vector(properties.color);
+        else if(key == "ambient") ok = tokens.number(properties.material_ambient);
+        else if(key == "diffuse") ok = tokens.number(properties.material_diffuse);
+        else if(key == "specular") ok = tokens.number(properties.material_specular);
+        else if(key == "shininess") ok = tokens.number(properties.material_shininess);
+        else if(key == "reflectance") ok = tokens.number(properties.reflectance);
+        else if(key == "refractance") ok = tokens.number(properties.refractance);
+        else if(key == "ior") ok = tokens.number(properties.refractive_index);
+        else return "unknown material property '" + key + "'";
+        if(!ok) return "bad value for " + key;
+      }
+      properties.classify();
+      materials[name] = properties;
+    } else if(kind == "sphere") {
+      vec3 center;
+      float radius;
+      if(!tokens.vector(center) || !tokens.number(radius)) return "sphere needs <x> <y> <z> <radius> <material>";
+      ShaderProperties properties;
+      std::string error = material(tokens.next(), properties);
+      if(!error.empty()) return error;
+      spheres.push_back(Sphere(vec4(center, 1), radius, properties));
+    } else if(kind == "triangle") {
+      ShaderProperties properties;
+      std::string error = material(tokens.next(), properties);
+      if(!error.empty()) return error;
+      vec3 a, b, c;
+      if(!tokens.vector(a) || !tokens.vector(b) || !tokens.vector(c)) return "triangle needs three corners";
+      triangles.push_back(Triangle(vec4(a, 1), vec4(b, 1), vec4(c, 1), properties));
+    } else if(kind == "mesh") {
+      MeshReference reference;
+      reference.path = tokens.next();
+      if(reference.path.empty()) return "mesh needs a file";
+      if(reference.path[0] != '/') reference.path = directory + reference.path;
+      std::string error = material(tokens.next(), reference.properties);
+      if(!error.empty()) return error;
+      reference.base = vec3(0, 1, 0);
+      reference.size = 0.8f;
+      while(!tokens.done()) {
+        std::string key = tokens.next();
+        bool ok;
+        if(key == "at") ok = tokens.vector(reference.base);
+        else if(key == "size") ok = tokens.number(reference.size);
+        else return "unknown mesh property '" + key + "'";
+        if(!ok) return "bad value for " + key;
+      }
+      meshes.push_back(reference);
+    } else if(kind == "object") {
+      std::string name = tokens.next();
+      ObjectReference reference;
+      reference.path = tokens.next();
+      if(name.empty() || reference.path.empty()) return "object needs <name> <file.obj> <material>";
+      if(reference.path[0] != '/') reference.path = directory + reference.path;
+      std::string error = material(tokens.next(), reference.properties);
+      if(!error.empty()) return error;
+      object_names[name] = objects.size();
+      objects.push_back(reference);
+    } else if(kind == "instance") {
+      std::string name = tokens.next();
+      std::map<std::string, uint32_t>::const_iterator found = object_names.find(name);
+      if(found == object_names.end()) return name.empty() ? "instance needs an object" : "unknown object '" + name + "'";
+      InstanceReference reference;
+      reference.object = found->second;
+      reference.base = vec3(0, 1, 0);
+      reference.scale = 1;
+      reference.rotation = 0;
+      while(!tokens.done()) {
+        std::string key = tokens.next();
+        bool ok;
+        if(key == "at") ok = tokens.vector(reference.base);
+        else if(key == "scale") ok = tokens.number(reference.scale) && reference.scale != 0;
+        else if(key == "rotate") ok = tokens.number(reference.rotation);
+        else return "unknown instance property '" + key + "'";
+        if(!ok) return "bad value for " + key;
+      }
+      instances.push_back(reference);
+    } else if(kind == "light") {
+      vec3 position(0, 0, 0), color(1, 1, 1), attenuation(1, 0, 0);
+      float ambient = 0.1f, diffuse = 1, specular = 1, size = 0;
+      while(!tokens.done()) {
+        std::string key = tokens.next();
+        bool ok;
+        if(key == "position") ok = tokens.vector(position);
+        else if(key == "color") ok = tokens.vector(color);
+        else if(key == "ambient") ok = tokens.number(ambient);
+        else if(key == "diffuse") ok = tokens.number(diffuse);
+        else if(key == "specular") ok = tokens.number(specular);
+        else if(key == "attenuation") ok = tokens.vector(attenuation);
+        else if(key == "size") ok = tokens.number(size);
+        else return "unknown light property '" + key + "'";
+        if(!ok) return "bad value for " + key;
+      }
+      lights.push_back(PointLight(vec4(position, 1.0), color, ambient, diffuse, specular, attenuation,
+        vec4(size, 0, 0, 1.0), vec4(0, 0, size, 1.0)));
+    } else if(kind == "camera") {
+      if(!tokens.vector(camera_position)) return "camera needs <x> <y> <z>";
+      camera_rotation = vec3(0, 0, 0);
+      if(!tokens.done() && !tokens.vector(camera_rotation)) return "camera rotation needs <yaw> <pitch> <roll>";
+      has_camera = true;
+    } else if(kind == "settings") {
+      std::string option = tokens.next();
+      if(option.empty()) return "settings needs an option";
+      settings.push_back("--" + option);
+      if(!tokens.done()) settings.push_back(tokens.next());
+    } else {
+      return "unknown entry '" + kind + "'";
+    }
+    return "";
+  }
+
+  std::string material(const std::string& name, ShaderProperties& properties) const {
+    if(name.empty()) return "missing material";
+    std::map<std::string, ShaderProperties>::const_iterator found = materials.find(name);
+    if(found == materials.end()) return "unknown material '" + name + "'";
+    properties = found->second;
+    return "";
+  }
+};
+
+#endif
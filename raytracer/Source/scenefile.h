@@ -0,0 +1,458 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using glm::vec4;
+
+// Binary scene container that is mapped and used in place. A SceneFileHeader is followed by a table of
+// SceneSection entries, then the sections themselves, each starting on a SCENE_SECTION_ALIGNMENT boundary.
+// The mesh arrays, which are nearly all of a big scene, are borrowed straight from the mapping, so opening
+// a scene costs a few page faults and the rest arrive as rays touch them. Materials, spheres and lights
+// are small and copied out, the interactive view edits the lights anyway. The scene's BVH is stored too, so
+// a converted scene needs no build at all, and the same container holding only the BVH sections serves as a
+// cache of the hierarchy for scenes loaded from other formats. A BVH stored with its scene is trusted, one
+// from a cache has to match the GeometryHash of the mesh it is used for.
+//
+// Instanced meshes are stored the same way, one section per array with every prototype's data one after the
+// other, and a PrototypeRecord per prototype says which slice is its own. Prototype BVHs index within their
+// own slices, so the slices are borrowed as they are. Instances and their top level BVH follow.
+//
+// Sections hold this build's structs as they are in memory, so every section records its element size and
+// a file from a build with different layouts is refused. Section types a build does not know are skipped.
+// Array contents are not checked, that would read every page, so only open files written by WriteSceneFile.
+//
+// Needs Scene from geometry.h, which has no include guard, so include this after TestModelH.h.
+const uint32_t SCENE_FILE_VERSION = 2;
+const uint32_t SCENE_BYTE_ORDER = 0x01020304;
+const size_t SCENE_SECTION_ALIGNMENT = 64;
+
+enum SceneSectionType {
+  SECTION_POSITIONS = 1,    // vec3 per vertex
+  SECTION_INDICES,          // three uint32 per face
+  SECTION_FACE_MATERIALS,   // uint32 per face
+  SECTION_MATERIALS,        // ShaderProperties
+  SECTION_SPHERES,          // Sphere
+  SECTION_LIGHTS,           // PointLight
+  SECTION_BVH_NODES,        // BVHNode
+  SECTION_BVH_PRIMITIVES,   // uint32 per face or instance
+  SECTION_BVH_INFO,         // one BVHInfo
+  SECTION_PROTOTYPES,       // PrototypeRecord
+  SECTION_PROTOTYPE_POSITIONS,
+  SECTION_PROTOTYPE_INDICES,
+  SECTION_PROTOTYPE_FACE_MATERIALS,
+  SECTION_PROTOTYPE_BVH_NODES,
+  SECTION_PROTOTYPE_BVH_PRIMITIVES,
+  SECTION_INSTANCES,        // Instance
+  SECTION_INSTANCE_BVH_NODES,
+  SECTION_INSTANCE_BVH_PRIMITIVES,
+  SECTION_INSTANCE_BVH_INFO
+};
+
+// Where one prototype's arrays start in the prototype sections, and how long they are
+struct PrototypeRecord {
+  uint64_t first_position, position_count;
+  uint64_t first_face, face_count;          // indices and face materials, three indices per face
+  uint64_t first_node, node_count;
+  uint64_t first_primitive;                 // face_count of them
+  uint64_t geometry_hash;
+};
+
+struct SceneFileHeader {
+  char magic[4];            // "RTSC"
+  uint32_t version;
+  uint32_t byte_order;      // SCENE_BYTE_ORDER as the writer saw it
+  uint32_t section_count;
+  uint64_t file_size;
+  float camera[4];          // initial camera position
+  float rotation[4];        // and yaw, pitch, roll, the last value is unused
+};
+
+struct SceneSection {
+  uint32_t type;
+  uint32_t element_size;
+  uint64_t offset;          // from the start of the file
+  uint64_t count;
+};
+
+inline uint64_t AlignSection(uint64_t offset) {
+  return (offset + SCENE_SECTION_ALIGNMENT - 1) & ~(uint64_t)(SCENE_SECTION_ALIGNMENT - 1);
+}
+
+struct SectionSource {
+  uint32_t type;
+  uint32_t element_size;
+  const void* data;
+  uint64_t count;
+};
+
+// nodes_type is SECTION_BVH_NODES or SECTION_INSTANCE_BVH_NODES, primitives and info follow it
+void AddBVHSections(const BVH& bvh, std::vector<SectionSource>& sources, uint32_t nodes_type = SECTION_BVH_NODES) {
+  if(bvh.empty()) return;
+  SectionSource bvh_sources[] = {
+    { nodes_type, sizeof(BVHNode), bvh.nodes.data(), bvh.nodes.size() },
+    { nodes_type + 1, sizeof(uint32_t), bvh.primitives.data(), bvh.primitives.size() },
+    { nodes_type + 2, sizeof(BVHInfo), &bvh.info, 1 },
+  };
+  sources.insert(sources.end(), bvh_sources, bvh_sources + 3);
+}
+
+bool WriteSections(const std::string& path, const std::vector<SectionSource>& sources, vec4 camera, vec3 rotation) {
+  const int section_count = sources.size();
+
+  std::vector<SceneSection> sections(section_count);
+  uint64_t offset = sizeof(SceneFileHeader) + (section_count * sizeof(SceneSection));
+  for(int i = 0; i < section_count; i++) {
+    offset = AlignSection(offset);
+    sections[i].type = sources[i].type;
+    sections[i].element_size = sources[i].element_size;
+    sections[i].offset = offset;
+    sections[i].count = sources[i].count;
+    offset += sources[i].count * sources[i].element_size;
+  }
+
+  SceneFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RTSC", 4);
+  header.version = SCENE_FILE_VERSION;
+  header.byte_order = SCENE_BYTE_ORDER;
+  header.section_count = section_count;
+  header.file_size = offset;
+  memcpy(header.camera, &camera[0], sizeof(header.camera));
+  memcpy(header.rotation, &rotation[0], sizeof(float) * 3);
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) {
+    printf("Cannot write scene %s\n", path.c_str());
+    return false;
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(sections.data(), sizeof(SceneSection), section_count, file);
+  static const char padding[SCENE_SECTION_ALIGNMENT] = {};
+  for(int i = 0; i < section_count; i++) {
+    fwrite(padding, 1, sections[i].offset - ftello(file), file);
+    if(sources[i].count) fwrite(sources[i].data, sources[i].element_size, sources[i].count, file);
+  }
+  bool ok = !ferror(file);
+  ok = (fclose(file) == 0) && ok;
+  if(!ok) printf("Failed to write scene %s\n", path.c_str());
+  return ok;
+}
+
+bool WriteSceneFile(const std::string& path, const Scene& scene, vec4 camera, vec3 rotation) {
+  const Mesh& mesh = scene.scene_mesh;
+  SectionSource scene_sources[] = {
+    { SECTION_POSITIONS, sizeof(vec3), mesh.positions.data(), mesh.positions.size() },
+    { SECTION_INDICES, sizeof(uint32_t), mesh.indices.data(), mesh.indices.size() },
+    { SECTION_FACE_MATERIALS, sizeof(uint32_t), mesh.materials.data(), mesh.materials.size() },
+    { SECTION_MATERIALS, sizeof(ShaderProperties), scene.scene_materials.data(), scene.scene_materials.size() },
+    { SECTION_SPHERES, sizeof(Sphere), scene.scene_spheres.data(), scene.scene_spheres.size() },
+    { SECTION_LIGHTS, sizeof(PointLight), scene.scene_lights.data(), scene.scene_lights.size() },
+  };
+  std::vector<SectionSource> sources(scene_sources, scene_sources + 6);
+  AddBVHSections(scene.scene_bvh, sources);
+
+  //Prototypes are gathered into one array per kind, the records say where each one's slice starts
+  std::vector<PrototypeRecord> records;
+  std::vector<vec3> positions;
+  std::vector<uint32_t> indices, materials, primitives;
+  std::vector<BVHNode> nodes;
+  for(size_t i = 0; i < scene.scene_prototypes.size(); i++) {
+    const Prototype& prototype = scene.scene_prototypes[i];
+    const Mesh& object = prototype.mesh;
+    bool stored = prototype.bvh.covers(object);
+    PrototypeRecord record = { positions.size(), object.positions.size(), materials.size(), object.faceCount(),
+                               nodes.size(), stored ? prototype.bvh.nodes.size() : 0, primitives.size(),
+                               stored ? prototype.bvh.info.geometry_hash : 0 };
+    records.push_back(record);
+    positions.insert(positions.end(), object.positions.data(), object.positions.data() + object.positions.size());
+    indices.insert(indices.end(), object.indices.data(), object.indices.data() + object.indices.size());
+    materials.insert(materials.end(), object.materials.data(), object.materials.data() + object.materials.size());
+    if(stored) {
+      nodes.insert(nodes.end(), prototype.bvh.nodes.data(), prototype.bvh.nodes.data() + prototype.bvh.nodes.size());
+      primitives.insert(primitives.end(), prototype.bvh.primitives.data(), prototype.bvh.primitives.data() + prototype.bvh.primitives.size());
+    } else {
+      primitives.resize(primitives.size() + object.faceCount());
+    }
+  }
+  if(!records.empty()) {
+    SectionSource prototype_sources[] = {
+      { SECTION_PROTOTYPES, sizeof(PrototypeRecord), records.data(), records.size() },
+      { SECTION_PROTOTYPE_POSITIONS, sizeof(vec3), positions.data(), positions.size() },
+      { SECTION_PROTOTYPE_INDICES, sizeof(uint32_t), indices.data(), indices.size() },
+      { SECTION_PROTOTYPE_FACE_MATERIALS, sizeof(uint32_t), materials.data(), materials.size() },
+      { SECTION_PROTOTYPE_BVH_NODES, sizeof(BVHNode), nodes.data(), nodes.size() },
+      { SECTION_PROTOTYPE_BVH_PRIMITIVES, sizeof(uint32_t), primitives.data(), primitives.size() },
+      { SECTION_INSTANCES, sizeof(Instance), scene.scene_instances.data(), scene.scene_instances.size() },
+    };
+    sources.insert(sources.end(), prototype_sources, prototype_sources + 7);
+    AddBVHSections(scene.scene_instance_bvh, sources, SECTION_INSTANCE_BVH_NODES);
+  }
+  return WriteSections(path, sources, camera, rotation);
+}
+
+bool WriteBVHFile(const std::string& path, const BVH& bvh) {
+  std::vector<SectionSource> sources;
+  AddBVHSections(bvh, sources);
+  return WriteSections(path, sources, vec4(0, 0, 0, 1), vec3(0, 0, 0));
+}
+
+// Binary scenes are told apart from text descriptions by their magic
+bool IsSceneFile(const std::string& path) {
+  char magic[4] = {};
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file) return false;
+  bool read = fread(magic, 1, 4, file) == 4;
+  fclose(file);
+  return read && memcmp(magic, "RTSC", 4) == 0;
+}
+
+// Keeps the mapping of an opened scene alive for as long as the scene borrows from it
+class SceneFile {
+public:
+  SceneFile() : mapped(NULL), size(0) {}
+
+  ~SceneFile() {
+    close();
+  }
+
+  // Replaces the contents of scene and sets the camera, prints why on failure
+  bool open(const std::string& path, Scene& scene, vec4& camera, vec3& rotation) {
+    Scene loaded;
+    if(!load(path, loaded, camera, rotation)) return false;
+
+    const Mesh& mesh = loaded.scene_mesh;
+    if(mesh.indices.size() != mesh.faceCount() * 3) {
+      printf("%s: face indices and materials disagree\n", path.c_str());
+      close();
+      return false;
+    }
+    if(!loaded.scene_bvh.empty() && !loaded.scene_bvh.covers(mesh)) {
+      printf("%s: stored BVH does not match the mesh, rebuilding\n", path.c_str());
+      loaded.scene_bvh = BVH();
+    }
+    scene = loaded;
+    return true;
+  }
+
+  // Reads a BVH written by WriteBVHFile, false without a message if there is none to read
+  bool openBVH(const std::string& path, BVH& bvh) {
+    if(access(path.c_str(), R_OK) != 0) return false;
+    Scene loaded;
+    vec4 camera;
+    vec3 rotation;
+    if(!load(path, loaded, camera, rotation) || loaded.scene_bvh.empty()) {
+      close();
+      return false;
+    }
+    bvh = loaded.scene_bvh;
+    return true;
+  }
+
+  void close() {
+    if(mapped) munmap(mapped, size);
+    mapped = NULL;
+    size = 0;
+  }
+
+private:
+  void* mapped;
+  size_t size;
+
+  SceneFile(const SceneFile&);
+  SceneFile& operator=(const SceneFile&);
+
+  bool load(const std::string& path, Scene& loaded, vec4& camera, vec3& rotation) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      printf("Cannot open scene %s\n", path.c_str());
+      return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SceneFileHeader)) {
+      printf("%s is not a scene file\n", path.c_str());
+      ::close(fd);
+      return false;
+    }
+    size = (size_t)info.st_size;
+    mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+      mapped = NULL;
+      printf("Cannot map scene %s\n", path.c_str());
+      return false;
+    }
+
+    const char* base = (const char*)mapped;
+    const SceneFileHeader* header = (const SceneFileHeader*)base;
+    if(memcmp(header->magic, "RTSC", 4) != 0 || header->version != SCENE_FILE_VERSION ||
+       header->byte_order != SCENE_BYTE_ORDER || header->file_size != size ||
+       sizeof(SceneFileHeader) + ((uint64_t)header->section_count * sizeof(SceneSection)) > size) {
+      printf("%s is not a scene file this build can read\n", path.c_str());
+      close();
+      return false;
+    }
+
+    const SceneSection* sections = (const SceneSection*)(base + sizeof(SceneFileHeader));
+    Mesh prototype_arrays;
+    BVH prototype_bvhs;
+    const PrototypeRecord* records = NULL;
+    uint64_t record_count = 0;
+    for(uint32_t i = 0; i < header->section_count; i++) {
+      const SceneSection& section = sections[i];
+      const void* data = base + section.offset;
+      if(section.offset % SCENE_SECTION_ALIGNMENT != 0 || section.offset > size ||
+         (section.element_size && section.count > (size - section.offset) / section.element_size)) {
+        printf("%s: section %u is out of bounds\n", path.c_str(), i);
+        close();
+        return false;
+      }
+
+      bool sized = true;
+      switch(section.type) {
+        case SECTION_BVH_NODES:
+          sized = section.element_size == sizeof(BVHNode);
+          loaded.scene_bvh.nodes.borrow((const BVHNode*)data, section.count);
+          break;
+        case SECTION_BVH_PRIMITIVES:
+          sized = section.element_size == sizeof(uint32_t);
+          loaded.scene_bvh.primitives.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_BVH_INFO:
+          sized = section.element_size == sizeof(BVHInfo) && section.count == 1;
+          if(sized) memcpy(&loaded.scene_bvh.info, data, sizeof(BVHInfo));
+          break;
+        case SECTION_INSTANCE_BVH_NODES:
+          sized = section.element_size == sizeof(BVHNode);
+          loaded.scene_instance_bvh.nodes.borrow((const BVHNode*)data, section.count);
+          break;
+        case SECTION_INSTANCE_BVH_PRIMITIVES:
+          sized = section.element_size == sizeof(uint32_t);
+          loaded.scene_instance_bvh.primitives.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_INSTANCE_BVH_INFO:
+          sized = section.element_size == sizeof(BVHInfo) && section.count == 1;
+          if(sized) memcpy(&loaded.scene_instance_bvh.info, data, sizeof(BVHInfo));
+          break;
+        case SECTION_PROTOTYPES:
+          sized = section.element_size == sizeof(PrototypeRecord);
+          records = (const PrototypeRecord*)data;
+          record_count = section.count;
+          break;
+        case SECTION_PROTOTYPE_POSITIONS:
+          sized = section.element_size == sizeof(vec3);
+          prototype_arrays.positions.borrow((const vec3*)data, section.count);
+          break;
+        case SECTION_PROTOTYPE_INDICES:
+          sized = section.element_size == sizeof(uint32_t);
+          prototype_arrays.indices.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_PROTOTYPE_FACE_MATERIALS:
+          sized = section.element_size == sizeof(uint32_t);
+          prototype_arrays.materials.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_PROTOTYPE_BVH_NODES:
+          sized = section.element_size == sizeof(BVHNode);
+          prototype_bvhs.nodes.borrow((const BVHNode*)data, section.count);
+          break;
+        case SECTION_PROTOTYPE_BVH_PRIMITIVES:
+          sized = section.element_size == sizeof(uint32_t);
+          prototype_bvhs.primitives.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_INSTANCES:
+          sized = section.element_size == sizeof(Instance);
+          if(sized) loaded.scene_instances.assign((const Instance*)data, (const Instance*)data + section.count);
+          break;
+        case SECTION_POSITIONS:
+          sized = section.element_size == sizeof(vec3);
+          loaded.scene_mesh.positions.borrow((const vec3*)data, section.count);
+          break;
+        case SECTION_INDICES:
+          sized = section.element_size == sizeof(uint32_t);
+          loaded.scene_mesh.indices.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_FACE_MATERIALS:
+          sized = section.element_size == sizeof(uint32_t);
+          loaded.scene_mesh.materials.borrow((const uint32_t*)data, section.count);
+          break;
+        case SECTION_MATERIALS:
+          sized = section.element_size == sizeof(ShaderProperties);
+          if(sized) loaded.scene_materials.assign((const ShaderProperties*)data, (const ShaderProperties*)data + section.count);
+          break;
+        case SECTION_SPHERES:
+          sized = section.element_size == sizeof(Sphere);
+          if(sized) loaded.scene_spheres.assign((const Sphere*)data, (const Sphere*)data + section.count);
+          break;
+        case SECTION_LIGHTS:
+          sized = section.element_size == sizeof(PointLight);
+          if(sized) loaded.scene_lights.assign((const PointLight*)data, (const PointLight*)data + section.count);
+          break;
+      }
+      if(!sized) {
+        printf("%s: section %u was written by a build with different data layouts\n", path.c_str(), i);
+        close();
+        return false;
+      }
+    }
+
+    if(loaded.scene_bvh.primitives.size() != loaded.scene_bvh.info.primitive_count ||
+       loaded.scene_instance_bvh.primitives.size() != loaded.scene_instance_bvh.info.primitive_count) {
+      printf("%s: BVH sections are incomplete\n", path.c_str());
+      close();
+      return false;
+    }
+
+    //Each prototype borrows its slices of the shared prototype sections
+    const SharedArray<vec3>& positions = prototype_arrays.positions;
+    const SharedArray<uint32_t>& indices = prototype_arrays.indices;
+    const SharedArray<uint32_t>& materials = prototype_arrays.materials;
+    const SharedArray<BVHNode>& nodes = prototype_bvhs.nodes;
+    const SharedArray<uint32_t>& primitives = prototype_bvhs.primitives;
+    for(uint64_t i = 0; i < record_count; i++) {
+      const PrototypeRecord& record = records[i];
+      if(record.first_position + record.position_count > positions.size() ||
+         (record.first_face + record.face_count) * 3 > indices.size() ||
+         record.first_face + record.face_count > materials.size() ||
+         record.first_node + record.node_count > nodes.size() ||
+         record.first_primitive + record.face_count > primitives.size()) {
+        printf("%s: prototype %llu is out of bounds\n", path.c_str(), (unsigned long long)i);
+        close();
+        return false;
+      }
+      loaded.scene_prototypes.push_back(Prototype());
+      Prototype& prototype = loaded.scene_prototypes.back();
+      prototype.mesh.positions.borrow(positions.data() + record.first_position, record.position_count);
+      prototype.mesh.indices.borrow(indices.data() + (record.first_face * 3), record.face_count * 3);
+      prototype.mesh.materials.borrow(materials.data() + record.first_face, record.face_count);
+      if(record.node_count > 0) {
+        prototype.bvh.nodes.borrow(nodes.data() + record.first_node, record.node_count);
+        prototype.bvh.primitives.borrow(primitives.data() + record.first_primitive, record.face_count);
+        prototype.bvh.info.geometry_hash = record.geometry_hash;
+        prototype.bvh.info.primitive_count = record.face_count;
+      }
+    }
+    for(size_t i = 0; i < loaded.scene_instances.size(); i++) {
+      if(loaded.scene_instances[i].prototype >= loaded.scene_prototypes.size()) {
+        printf("%s: instance %zu has no prototype\n", path.c_str(), i);
+        close();
+        return false;
+      }
+    }
+
+    camera = vec4(header->camera[0], header->camera[1], header->camera[2], header->camera[3]);
+    rotation = vec3(header->rotation[0], header->rotation[1], header->rotation[2]);
+    return true;
+  }
+};
+
+#endif
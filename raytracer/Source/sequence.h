@@ -0,0 +1,198 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+using glm::vec3;
+
+// Keyframed camera and light paths for rendering a frame sequence in one process. Keys are linearly
+// interpolated, frames before the first key or after the last one hold that key's value. The file is
+// plain text, one entry per line, # starts a comment:
+//
+//   frames <count>
+//   camera <frame> <x> <y> <z> <yaw> <pitch> <roll>
+//   light <frame> <light index> <x> <y> <z>
+//   sphere <frame> <sphere index> <x> <y> <z>
+
+struct CameraKey {
+  int frame;
+  vec3 position;
+  vec3 rotation;   // yaw, pitch, roll
+};
+
+// Key for anything that only moves, lights and spheres
+struct PositionKey {
+  int frame;
+  vec3 position;
+};
+
+class Sequence {
+public:
+  int frames;
+  std::vector<CameraKey> camera;
+  std::vector<std::vector<PositionKey> > lights;    // per light index, empty when the light does not move
+  std::vector<std::vector<PositionKey> > spheres;   // per sphere index, likewise
+
+  Sequence() : frames(0) {}
+
+  bool load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "r");
+    if(!file) {
+      printf("Cannot open sequence %s\n", path.c_str());
+      return false;
+    }
+
+    char line[512];
+    int number = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), file)) {
+      number++;
+      char* comment = strchr(line, '#');
+      if(comment) *comment = '\0';
+
+      char kind[16];
+      if(sscanf(line, "%15s", kind) != 1) continue;
+
+      if(!strcmp(kind, "frames")) {
+        ok = sscanf(line, "%*s %d", &frames) == 1 && frames > 0;
+      } else if(!strcmp(kind, "camera")) {
+        CameraKey key;
+        ok = sscanf(line, "%*s %d %f %f %f %f %f %f", &key.frame, &key.position.x, &key.position.y, &key.position.z,
+          &key.rotation.x, &key.rotation.y, &key.rotation.z) == 7;
+        if(ok) camera.push_back(key);
+      } else if(!strcmp(kind, "light") || !strcmp(kind, "sphere")) {
+        PositionKey key;
+        int index;
+        ok = sscanf(line, "%*s %d %d %f %f %f", &key.frame, &index, &key.position.x, &key.position.y, &key.position.z) == 5 && index >= 0;
+        if(ok) {
+          std::vector<std::vector<PositionKey> >& keys = kind[0] == 'l' ? lights : spheres;
+          if(index >= (int)keys.size()) keys.resize(index + 1);
+          keys[index].push_back(key);
+        }
+      } else {
+        ok = false;
+      }
+
+      if(!ok) printf("%s:%d: cannot parse '%s'\n", path.c_str(), number, kind);
+    }
+    fclose(file);
+
+    if(ok && frames == 0) {
+      printf("%s: missing 'frames <count>'\n", path.c_str());
+      ok = false;
+    }
+
+    std::sort(camera.begin(), camera.end(), [](const CameraKey& a, const CameraKey& b) { return a.frame < b.frame; });
+    for(size_t i = 0; i < lights.size(); i++) SortKeys(lights[i]);
+    for(size_t i = 0; i < spheres.size(); i++) SortKeys(spheres[i]);
+    return ok;
+  }
+
+  // False if the camera has no keys and keeps its default placement
+  bool cameraAt(int frame, vec3& position, vec3& rotation) const {
+    if(camera.empty()) return false;
+    size_t next;
+    float t = Locate(camera, frame, next);
+    const CameraKey& a = camera[next > 0 ? next - 1 : 0];
+    const CameraKey& b = camera[next];
+    position = glm::mix(a.position, b.position, t);
+    rotation = glm::mix(a.rotation, b.rotation, t);
+    return true;
+  }
+
+  // False if this light has no keys and stays where the scene put it
+  bool lightAt(int light, int frame, vec3& position) const {
+    return PositionAt(lights, light, frame, position);
+  }
+
+  // False if this sphere has no keys and stays where the scene put it
+  bool sphereAt(int sphere, int frame, vec3& position) const {
+    return PositionAt(spheres, sphere, frame, position);
+  }
+
+private:
+  static void SortKeys(std::vector<PositionKey>& keys) {
+    std::sort(keys.begin(), keys.end(), [](const PositionKey& a, const PositionKey& b) { return a.frame < b.frame; });
+  }
+
+  static bool PositionAt(const std::vector<std::vector<PositionKey> >& paths, int index, int frame, vec3& position) {
+    if(index >= (int)paths.size() || paths[index].empty()) return false;
+    const std::vector<PositionKey>& keys = paths[index];
+    size_t next;
+    float t = Locate(keys, frame, next);
+    position = glm::mix(keys[next > 0 ? next - 1 : 0].position, keys[next].position, t);
+    return true;
+  }
+
+  // Index of the first key after frame (clamped to the last key) and how far frame is from the key before it
+  template <typename Key>
+  static float Locate(const std::vector<Key>& keys, int frame, size_t& next) {
+    next = 0;
+    while(next < keys.size() && keys[next].frame <= frame) next++;
+    if(next == 0) return 0;
+    if(next == keys.size()) {
+      next = keys.size() - 1;
+      return 1;
+    }
+    const Key& a = keys[next - 1];
+    const Key& b = keys[next];
+    return ((float)(frame - a.frame)) / ((float)(b.frame - a.frame));
+  }
+};
+
+// render.png -> render_0007.png, or the frame number goes where the output has a %d, %4d or %04d. Only the
+// first of those is the frame number, %% and any other % stay in the name as a percent sign. The output is
+// never used as a printf format.
+std::string FramePath(const std::string& output, int frame) {
+  std::string prefix, suffix;
+  bool numbered = false;
+  bool zero_pad = true;
+  int width = 4;
+  for(size_t i = 0; i < output.size(); i++) {
+    std::string& target = numbered ? suffix : prefix;
+    if(output[i] != '%') {
+      target += output[i];
+      continue;
+    }
+    if(i + 1 < output.size() && output[i + 1] == '%') {
+      target += '%';
+      i++;
+      continue;
+    }
+    size_t end = i + 1;
+    bool zero = end < output.size() && output[end] == '0';
+    if(zero) end++;
+    size_t digits = end;
+    while(end < output.size() && isdigit((unsigned char)output[end])) end++;
+    if(!numbered && end - digits <= 3 && end < output.size() && output[end] == 'd') {
+      numbered = true;
+      zero_pad = zero;
+      width = atoi(output.substr(digits, end - digits).c_str());
+      i = end;
+      continue;
+    }
+    target += '%';
+  }
+
+  if(!numbered) {
+    size_t dot = prefix.find_last_of('.');
+    size_t slash = prefix.find_last_of('/');
+    if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+      suffix = prefix.substr(dot);
+      prefix.erase(dot);
+    }
+    prefix += "_";
+  }
+  char number[32];
+  snprintf(number, sizeof(number), zero_pad ? "%0*d" : "%*d", width, frame);
+  return prefix + number + suffix;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+// Quality settings of the shaders, chosen at run time from the command line or a scene description's
+// settings lines rather than compiled in. The shaders are handed the settings they render with, and the
+// shading kernels read them through a settings policy class: PresetSettings returns the values of
+// DEFAULT_SETTINGS as constants, so the kernels built with it have the usual loops unrolled and dead ones
+// removed as before, and RuntimeSettings returns the values it is handed. MainShader takes the preset kernels
+// whenever the settings the kernels read still match the preset, the photon count and radius are only used
+// outside them.
+
+struct RenderSettings {
+  int monte_carlo_depth;     // bounces of indirect light
+  int monte_carlo_breadth;   // indirect rays per bounce
+  int refraction_depth;      // reflection and refraction bounces
+  int light_samples;         // shadow rays per area light are light_samples * light_samples
+  int photon_samples;        // caustic photons emitted per light
+  float radiance_size;       // radius of the photon lookup for caustics
+};
+
+const RenderSettings DEFAULT_SETTINGS = { 1, 16, 8, 1, 200000, 0.04f };
+
+// The settings the shading kernels are compiled for
+inline bool SameKernelSettings(const RenderSettings& a, const RenderSettings& b) {
+  return a.monte_carlo_depth == b.monte_carlo_depth && a.monte_carlo_breadth == b.monte_carlo_breadth &&
+         a.refraction_depth == b.refraction_depth && a.light_samples == b.light_samples;
+}
+
+inline bool SameSettings(const RenderSettings& a, const RenderSettings& b) {
+  return SameKernelSettings(a, b) && a.photon_samples == b.photon_samples && a.radiance_size == b.radiance_size;
+}
+
+struct PresetSettings {
+  static int monteCarloDepth(const RenderSettings&) { return DEFAULT_SETTINGS.monte_carlo_depth; }
+  static int monteCarloBreadth(const RenderSettings&) { return DEFAULT_SETTINGS.monte_carlo_breadth; }
+  static int refractionDepth(const RenderSettings&) { return DEFAULT_SETTINGS.refraction_depth; }
+  static int lightSamples(const RenderSettings&) { return DEFAULT_SETTINGS.light_samples; }
+};
+
+struct RuntimeSettings {
+  static int monteCarloDepth(const RenderSettings& settings) { return settings.monte_carlo_depth; }
+  static int monteCarloBreadth(const RenderSettings& settings) { return settings.monte_carlo_breadth; }
+  static int refractionDepth(const RenderSettings& settings) { return settings.refraction_depth; }
+  static int lightSamples(const RenderSettings& settings) { return settings.light_samples; }
+};
+
+#endif
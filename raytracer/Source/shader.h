@@ -3,22 +3,20 @@
 #include <glm/glm.hpp>
 #include "raymath.h"
 #include "kdtree.h"
+#include "sampler.h"
+#include "settings.h"
 
 using namespace std;
 using glm::vec3;
 using glm::mat3;
 
-const int MONTE_CARLO_DEPTH = 1;
-const int MONTE_CARLO_BREADTH = 16;
+//Sample counts and depths are in the RenderSettings the shaders are handed, see settings.h
 mat4 MONTE_CARLO_MATRIX;
 
-const int REFRACTION_DEPTH = 8;
-const int LIGHT_SAMPLES = 1;
+const int MIS_BRDF_SAMPLES = 1;
 
-const int PHOTON_SAMPLES = 200000;
 const float distance_falloff = 2;
 const float distance_multiplier = 20;
-const float radiance_size = 0.04f;
 const float light_mult = 50.f;
 std::vector<Photon> photon_map;
 int tree_size = 0;
@@ -27,15 +25,18 @@ kdtree* photon_tree;
 // Node* photon_tree = NULL;
 //
 
-vec3 MainShader(Scene &scene, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth);
+vec3 MainShader(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth);
+template <typename Settings>
+vec3 ShadeWith(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth);
 
-vec3 getCausticValues(Scene &scene, const Intersection& intersect) {
+vec3 getCausticValues(Scene &scene, const RenderSettings& settings, const Intersection& intersect) {
 
   struct kdres *presults;
   double pt[3] = { intersect.position.x, intersect.position.y, intersect.position.z};
 
-  presults = kd_nearest_range( photon_tree, pt, radiance_size );
+  presults = kd_nearest_range( photon_tree, pt, settings.radiance_size );
   float numberInRange = kd_res_size(presults);
+  CountStat(STAT_PHOTON_RESULTS, kd_res_size(presults));
 
   return light_mult * (vec3(1, 1, 1) + intersect.properties.color) * (numberInRange) / ((float)tree_size + 1);
 
@@ -67,6 +68,7 @@ vec3 getCausticValues(Scene &scene, const Intersection& intersect) {
 
 bool isObscured(Scene &scene, vec4 start, vec4 direction, float target) {
   Intersection obscureTest;
+  CountStat(STAT_SHADOW_RAYS);
   bool intersect = ClosestIntersection(start, direction, scene, obscureTest);
   if(!intersect) return false;
   return glm::distance(glm::vec3(obscureTest.position), glm::vec3(start)) < target;
@@ -74,8 +76,8 @@ bool isObscured(Scene &scene, vec4 start, vec4 direction, float target) {
 
 vec3 monteCarloSample(float m) {
 
-  float u = drand48();
-  float v = drand48();
+  float u = NextSample();
+  float v = NextSample();
 
   float theta_a = acos(pow(1 - u, 1 / (1 + m)));
   float theta_b = 2 * M_PI * v;
@@ -87,23 +89,32 @@ vec3 monteCarloSample(float m) {
   );
 }
 
-vec3 InDirectLightingValues(Scene &scene, const Intersection& intersect, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+// The shading functions below are templates over the material's MaterialFeature bits, so each combination
+// gets a kernel without the branches and sampling its material has no use for, and over the settings policy
+// from settings.h they read sample counts and depths through. MainShader picks the kernel.
+
+template <typename Settings, unsigned Features>
+vec3 InDirectLightingValues(Scene &scene, const RenderSettings& settings, const Intersection& intersect, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+  const bool diffuse_material = (Features & FEATURE_DIFFUSE) != 0;
+  const bool specular_material = (Features & FEATURE_SPECULAR) != 0;
 
   vec3 summed_colors = vec3(0, 0, 0);
   vec3 specular_colors = vec3(0, 0, 0);
 
-  int breadth = MONTE_CARLO_BREADTH;
+  const int breadth = Settings::monteCarloBreadth(settings);
 
   vec3 Nt, Nb;
-  createCoordinateSystem(vec3(intersect.normal), Nt, Nb);
+  if(diffuse_material) createCoordinateSystem(vec3(intersect.normal), Nt, Nb);
 
-  vec3 reflected = reflect(vec3(direction), vec3(intersect.normal));
-  vec3 Ntr, Nbr;
-  createCoordinateSystem(reflected, Ntr, Nbr);
+  vec3 reflected, Ntr, Nbr;
+  if(specular_material) {
+    reflected = reflect(vec3(direction), vec3(intersect.normal));
+    createCoordinateSystem(reflected, Ntr, Nbr);
+  }
 
   for(int i = 0; i < breadth; i++) {
 
-    if(intersect.properties.material_diffuse > 0) {
+    if(diffuse_material) {
 
         vec3 sample = monteCarloSample(1);
         vec4 newDirection = vec4(
@@ -115,14 +126,15 @@ vec3 InDirectLightingValues(Scene &scene, const Intersection& intersect, vec4 or
         vec4 start = intersect.position + (newDirection * 0.0001f);
 
         Intersection indirectRay;
+        CountStat(STAT_INDIRECT_RAYS);
         bool intersect = ClosestIntersection(start, newDirection, scene, indirectRay);
         if(intersect) {
-          vec3 indirectColor = MainShader(scene, indirectRay, start, newDirection, reflect_depth, monte_carlo_depth + 1);
+          vec3 indirectColor = ShadeWith<Settings>(scene, settings, indirectRay, start, newDirection, reflect_depth, monte_carlo_depth + 1);
           summed_colors += (indirectColor);
         }
     }
 
-    if(intersect.properties.material_specular > 0) {
+    if(specular_material) {
       vec3 sample = monteCarloSample(intersect.properties.material_shininess);
       vec4 newDirection = vec4(
           sample.x * Nbr.x + sample.y * reflected.x + sample.z * Ntr.x,
@@ -133,99 +145,219 @@ vec3 InDirectLightingValues(Scene &scene, const Intersection& intersect, vec4 or
       vec4 start = intersect.position + (newDirection * 0.0001f);
 
       Intersection indirectRay;
+      CountStat(STAT_INDIRECT_RAYS);
       bool intersect = ClosestIntersection(start, newDirection, scene, indirectRay);
       if(intersect) {
-        vec3 indirectColor = MainShader(scene, indirectRay, start, newDirection, reflect_depth, monte_carlo_depth + 1);
+        vec3 indirectColor = ShadeWith<Settings>(scene, settings, indirectRay, start, newDirection, reflect_depth, monte_carlo_depth + 1);
         specular_colors += (indirectColor);
       }
     }
 
   }
 
-  if(MONTE_CARLO_BREADTH == 0) return summed_colors;
+  if(breadth == 0) return summed_colors;
 
-  summed_colors = summed_colors * intersect.properties.material_diffuse;
-  specular_colors = specular_colors * intersect.properties.material_specular;
+  if(diffuse_material) summed_colors = summed_colors * intersect.properties.material_diffuse;
+  if(specular_material) specular_colors = specular_colors * intersect.properties.material_specular;
 
   return ((summed_colors + specular_colors) / ((float)breadth));
 
 }
 
-vec3 DirectLightingValues(Scene &scene, const Intersection& i, vec4 origin, PointLight light) {
+float PhongLobePdf(float cos_r, float shininess) {
+  return ((shininess + 1) / (2 * M_PI)) * pow(cos_r, shininess);
+}
+
+float PowerHeuristic(int n_a, float pdf_a, int n_b, float pdf_b) {
+  float a = n_a * pdf_a;
+  float b = n_b * pdf_b;
+  if(a == 0) return 0;
+  return (a * a) / ((a * a) + (b * b));
+}
+
+float LightAttenuation(const PointLight &light, float distance) {
+  return (((light.attenuation.z * distance) + light.attenuation.y) * distance) + light.attenuation.x;
+}
+
+//Intersects a ray with the light's plane_a x plane_b parallelogram, returns distance along the normalised direction
+bool IntersectLightArea(const PointLight &light, vec3 start, vec3 direction, float &t) {
+  vec3 a = vec3(light.plane_a);
+  vec3 b = vec3(light.plane_b);
+  vec3 n = cross(a, b);
+
+  float facing = dot(direction, n);
+  if(fabsf(facing) < 1e-12f) return false;
+
+  t = dot(vec3(light.lightPos) - start, n) / facing;
+  if(t <= 0) return false;
+
+  vec3 q = start + (direction * t) - vec3(light.lightPos);
+  float aa = dot(a, a), ab = dot(a, b), bb = dot(b, b);
+  float qa = dot(q, a), qb = dot(q, b);
+  float det = (aa * bb) - (ab * ab);
+  float grad_x = ((qa * bb) - (qb * ab)) / det;
+  float grad_y = ((qb * aa) - (qa * ab)) / det;
+
+  return fabsf(grad_x) <= 0.5f && fabsf(grad_y) <= 0.5f;
+}
+
+template <typename Settings, unsigned Features>
+vec3 DirectLightingValues(Scene &scene, const RenderSettings& settings, const Intersection& i, vec4 origin, const PointLight &light) {
+  const bool diffuse_material = (Features & FEATURE_DIFFUSE) != 0;
+  const bool specular_material = (Features & FEATURE_SPECULAR) != 0;
+  const int samples = Settings::lightSamples(settings);
 
   vec3 difference = vec3(light.lightPos - i.position);
   float distance = length(difference);
   vec3 ambient = i.properties.color * light.component_ambient * i.properties.material_ambient;
 
+  if(!diffuse_material && !specular_material) {
+    //Only ambient light reaches the camera, shadow rays would not change that
+    SkipSamples(samples * (samples + 1));
+    return ambient;
+  }
+
   // Intersection shadowTest;
   const float offset = 0.0001f;
   vec4 start = i.position + (offset * i.normal);
 
+  vec3 normal = vec3(i.normal);
+  vec3 camera_difference = vec3(i.position - origin);
+  float shininess = i.properties.material_shininess;
+  bool glossy = specular_material && light.component_specular > 0;
+
+  vec3 reflected, light_normal;
+  float light_area = 0;
+  if(glossy) {
+    reflected = glm::normalize(reflect(camera_difference, normal));
+    light_normal = cross(vec3(light.plane_a), vec3(light.plane_b));
+    light_area = length(light_normal);
+    if(light_area > 0) light_normal = light_normal / light_area;
+  }
+
+  //Specular highlights are estimated by both light sampling and Phong lobe sampling, combined by the power heuristic
+  const int light_strategy = samples * samples;
+  const int lobe_strategy = light_area > 0 ? MIS_BRDF_SAMPLES : 0;
+
   int light_samples = 0;
+  float specular_light = 0;
+
+  for (int light_x = 0; light_x < samples; light_x++) {
+
+    float grad_x = (((float)light_x + NextSample()) / ((float)samples)) - 0.5f;
+
+    vec3 light_difference = difference + (vec3(light.plane_a) * grad_x);
 
-  for (int light_x = 0; light_x < LIGHT_SAMPLES; light_x++) {
+    for (int light_y = 0; light_y < samples; light_y++) {
 
-    float grad_x = (((float)light_x) / ((float)LIGHT_SAMPLES)) - 0.5f;
+        float grad_y = (((float)light_y + NextSample()) / ((float)samples)) - 0.5f;
 
-    vec4 light_difference = vec4(difference, 1) + (light.plane_a * grad_x);
+        vec3 light_difference_x = light_difference + (vec3(light.plane_b) * grad_y);
 
-    for (int light_y = 0; light_y < LIGHT_SAMPLES; light_y++) {
+        if(isObscured(scene, start, vec4(light_difference_x, 1), distance)) continue;
+        light_samples++;
 
-        float grad_y = (((float)light_y) / ((float)LIGHT_SAMPLES)) - 0.5f;
+        if(!glossy) continue;
 
-        vec4 light_difference_x = light_difference + (light.plane_b * grad_y);
+        float sample_distance = length(light_difference_x);
+        vec3 towards = light_difference_x / sample_distance;
+        float cos_r = max(dot(towards, reflected), 0.f);
+        if(cos_r <= 0) continue;
 
-        if(!isObscured(scene, start, light_difference_x, distance)) light_samples++;
+        float lobe_pdf = 0;
+        if(lobe_strategy > 0 && dot(towards, normal) > 0) {
+          lobe_pdf = PhongLobePdf(cos_r, shininess) * fabsf(dot(towards, light_normal)) / (sample_distance * sample_distance);
+        }
+        float light_pdf = light_area > 0 ? 1.f / light_area : 1.f;
+        float weight = lobe_strategy > 0 ? PowerHeuristic(light_strategy, light_pdf, lobe_strategy, lobe_pdf) : 1.f;
+
+        specular_light += weight * pow(cos_r, shininess) / LightAttenuation(light, sample_distance);
     }
   }
-  if(light_samples == 0) {
-    return ambient;
+
+  float specular_lobe = 0;
+
+  if(glossy && lobe_strategy > 0) {
+    vec3 Ntr, Nbr;
+    createCoordinateSystem(reflected, Ntr, Nbr);
+
+    for(int s = 0; s < lobe_strategy; s++) {
+      vec3 sample = monteCarloSample(shininess);
+      vec3 towards = vec3(
+          sample.x * Nbr.x + sample.y * reflected.x + sample.z * Ntr.x,
+          sample.x * Nbr.y + sample.y * reflected.y + sample.z * Ntr.y,
+          sample.x * Nbr.z + sample.y * reflected.z + sample.z * Ntr.z);
+
+      if(dot(towards, normal) <= 0) continue;
+
+      float sample_distance;
+      if(!IntersectLightArea(light, vec3(start), towards, sample_distance)) continue;
+      if(isObscured(scene, start, vec4(towards, 1), sample_distance)) continue;
+
+      float cos_l = fabsf(dot(towards, light_normal));
+      float cos_r = max(dot(towards, reflected), 0.f);
+      if(cos_l <= 0 || cos_r <= 0) continue;
+
+      float lobe_pdf = PhongLobePdf(cos_r, shininess) * cos_l / (sample_distance * sample_distance);
+      float weight = PowerHeuristic(lobe_strategy, lobe_pdf, light_strategy, 1.f / light_area);
+
+      specular_lobe += weight * pow(cos_r, shininess) / (LightAttenuation(light, sample_distance) * light_area * lobe_pdf);
+    }
   }
 
-  float multiplier = ((float)light_samples) / ((float) LIGHT_SAMPLES * LIGHT_SAMPLES);
+  float specular_estimate = (specular_light / light_strategy) + (lobe_strategy > 0 ? specular_lobe / lobe_strategy : 0);
 
-  vec3 normal = vec3(i.normal);
-  float dotProduct = max(dot(normal, difference) / (length(normal) * length(difference)), 0.f);
-  vec3 camera_difference = vec3(i.position - origin);
-  vec3 reflected = reflect(camera_difference, normal);
-  float specularDotProduct = max(dot(difference, reflected) / (length(difference) * length(reflected)), 0.f);
+  if(light_samples == 0 && specular_estimate == 0) {
+    return ambient;
+  }
+
+  float multiplier = ((float)light_samples) / ((float) samples * samples);
 
-  vec3 diffuse = dotProduct * i.properties.color * light.color * i.properties.material_diffuse * light.component_diffuse;
-  vec3 specular = pow(specularDotProduct, i.properties.material_shininess) * light.color * i.properties.material_specular * light.component_specular;
-  float attenuation = (((light.attenuation.z * distance) + light.attenuation.y) * distance) + light.attenuation.x;
+  vec3 diffuse = vec3(0, 0, 0);
+  if(diffuse_material) {
+    float dotProduct = max(dot(normal, difference) / (length(normal) * length(difference)), 0.f);
+    diffuse = dotProduct * i.properties.color * light.color * i.properties.material_diffuse * light.component_diffuse;
+  }
+  vec3 specular = vec3(0, 0, 0);
+  if(specular_material) specular = specular_estimate * light.color * i.properties.material_specular * light.component_specular;
+  float attenuation = LightAttenuation(light, distance);
 
-  return (((diffuse + specular) * multiplier) / attenuation) + ambient;
+  return ((diffuse * multiplier) / attenuation) + specular + ambient;
 
 }
 
-vec3 MainShader(Scene &scene, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+template <typename Settings, unsigned Features>
+vec3 MainShaderKernel(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+  const bool reflective = (Features & FEATURE_REFLECT) != 0;
+  const bool refractive = (Features & FEATURE_REFRACT) != 0;
 
   vec3 color = vec3(0, 0, 0);
 
   for (int i = 0; i < (int)scene.scene_lights.size(); i++) {
-    color += DirectLightingValues(scene, intersection, origin, scene.scene_lights[i]);
+    color += DirectLightingValues<Settings, Features>(scene, settings, intersection, origin, scene.scene_lights[i]);
   }
 
-  if(monte_carlo_depth < MONTE_CARLO_DEPTH) {
-    color += ((InDirectLightingValues(scene, intersection, origin, direction, reflect_depth, monte_carlo_depth)));
+  if(monte_carlo_depth < Settings::monteCarloDepth(settings) && (Features & (FEATURE_DIFFUSE | FEATURE_SPECULAR))) {
+    color += ((InDirectLightingValues<Settings, Features>(scene, settings, intersection, origin, direction, reflect_depth, monte_carlo_depth)));
   }
 
-  if(reflect_depth < REFRACTION_DEPTH && (intersection.properties.reflectance > 0 || intersection.properties.refractance > 0)) {
+  if(reflect_depth < Settings::refractionDepth(settings) && (reflective || refractive)) {
     vec3 normal = vec3(intersection.normal);
 
-    if(intersection.properties.reflectance > 0) {
+    if(reflective) {
         float offset = 0.0001f;
         vec3 reflected = reflect(vec3(direction), normal);
         vec4 start = intersection.position + (offset * intersection.normal);
         Intersection reflected_ray;
+        CountStat(STAT_REFLECTION_RAYS);
         bool intersect = ClosestIntersection(start, vec4(reflected, 1), scene, reflected_ray);
         if(intersect) {
-          vec3 reflectColor = MainShader(scene, reflected_ray, start, vec4(reflected, 1), reflect_depth + 1, monte_carlo_depth);
+          vec3 reflectColor = ShadeWith<Settings>(scene, settings, reflected_ray, start, vec4(reflected, 1), reflect_depth + 1, monte_carlo_depth);
           color += reflectColor * intersection.properties.reflectance;
         }
     }
 
-    if(intersection.properties.refractance > 0) {
+    if(refractive) {
 
         float k = fresnel(vec3(direction), normal, intersection.properties.refractive_index);
         float facing = dot(direction, intersection.normal);
@@ -242,12 +374,14 @@ vec3 MainShader(Scene &scene, const Intersection& intersection, vec4 origin, vec
 
           //Total internal reflection
         Intersection reflected_ray;
+        CountStat(STAT_REFLECTION_RAYS);
         bool intersect = ClosestIntersection(start_reflect, vec4(reflected, 1), scene, reflected_ray);
-        if(intersect) refract_color += (MainShader(scene, reflected_ray, start_reflect, vec4(reflected, 1), reflect_depth + 1, monte_carlo_depth) * reflectRatio);
+        if(intersect) refract_color += (ShadeWith<Settings>(scene, settings, reflected_ray, start_reflect, vec4(reflected, 1), reflect_depth + 1, monte_carlo_depth) * reflectRatio);
 
         Intersection refracted_ray;
+        CountStat(STAT_REFRACTION_RAYS);
         intersect = ClosestIntersection(start_refract, vec4(refracted, 1), scene, refracted_ray);
-        if(intersect) refract_color += (MainShader(scene, refracted_ray, start_refract, vec4(refracted, 1), reflect_depth + 1, monte_carlo_depth) * refractRatio);
+        if(intersect) refract_color += (ShadeWith<Settings>(scene, settings, refracted_ray, start_refract, vec4(refracted, 1), reflect_depth + 1, monte_carlo_depth) * refractRatio);
 
         color += (refract_color * intersection.properties.refractance);
 
@@ -257,17 +391,46 @@ vec3 MainShader(Scene &scene, const Intersection& intersection, vec4 origin, vec
   }
 
   if(monte_carlo_depth == 0 && reflect_depth == 0) {
-    color += getCausticValues(scene, intersection);
+    color += getCausticValues(scene, settings, intersection);
   }
 
   return color;
 
 }
 
+typedef vec3 (*ShaderKernel)(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth);
+
+// Indexed by MaterialFeature bits
+template <typename Settings>
+struct ShaderKernels {
+  static const ShaderKernel table[FEATURE_COMBINATIONS];
+};
+
+template <typename Settings>
+const ShaderKernel ShaderKernels<Settings>::table[FEATURE_COMBINATIONS] = {
+  MainShaderKernel<Settings, 0>,  MainShaderKernel<Settings, 1>,  MainShaderKernel<Settings, 2>,  MainShaderKernel<Settings, 3>,
+  MainShaderKernel<Settings, 4>,  MainShaderKernel<Settings, 5>,  MainShaderKernel<Settings, 6>,  MainShaderKernel<Settings, 7>,
+  MainShaderKernel<Settings, 8>,  MainShaderKernel<Settings, 9>,  MainShaderKernel<Settings, 10>, MainShaderKernel<Settings, 11>,
+  MainShaderKernel<Settings, 12>, MainShaderKernel<Settings, 13>, MainShaderKernel<Settings, 14>, MainShaderKernel<Settings, 15>
+};
+
+template <typename Settings>
+vec3 ShadeWith(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+  return ShaderKernels<Settings>::table[intersection.properties.features](scene, settings, intersection, origin, direction, reflect_depth, monte_carlo_depth);
+}
+
+//Settings are looked at once per camera ray, the rays it spawns keep to the kernels it picked
+vec3 MainShader(Scene &scene, const RenderSettings& settings, const Intersection& intersection, vec4 origin, vec4 direction, int reflect_depth, int monte_carlo_depth) {
+  if(SameKernelSettings(settings, DEFAULT_SETTINGS)) {
+    return ShadeWith<PresetSettings>(scene, settings, intersection, origin, direction, reflect_depth, monte_carlo_depth);
+  }
+  return ShadeWith<RuntimeSettings>(scene, settings, intersection, origin, direction, reflect_depth, monte_carlo_depth);
+}
 
-Photon PropogatePhoton(Scene &scene, const Intersection& i, vec4 origin, vec4 direction, int depth) {
 
-  if (depth >= REFRACTION_DEPTH) return Photon(vec3(1, 1, 1), i.position);
+Photon PropogatePhoton(Scene &scene, const RenderSettings& settings, const Intersection& i, vec4 origin, vec4 direction, int depth) {
+
+  if (depth >= settings.refraction_depth) return Photon(vec3(1, 1, 1), i.position);
 
   vec3 normal = vec3(i.normal);
 
@@ -276,9 +439,10 @@ Photon PropogatePhoton(Scene &scene, const Intersection& i, vec4 origin, vec4 di
       vec3 reflected = reflect(vec3(direction), normal);
       vec4 start = i.position + (offset * i.normal);
       Intersection reflected_ray;
+      CountStat(STAT_PHOTON_RAYS);
       bool intersect = ClosestIntersection(start, vec4(reflected, 1), scene, reflected_ray);
       if(intersect) {
-        return PropogatePhoton(scene, reflected_ray, start, vec4(reflected, 1), depth + 1);
+        return PropogatePhoton(scene, settings, reflected_ray, start, vec4(reflected, 1), depth + 1);
       }
   }
 
@@ -296,15 +460,17 @@ Photon PropogatePhoton(Scene &scene, const Intersection& i, vec4 origin, vec4 di
 
         //Total internal reflection
       Intersection reflected_ray;
+      CountStat(STAT_PHOTON_RAYS);
       bool intersect = ClosestIntersection(start_reflect, vec4(reflected, 1), scene, reflected_ray);
       if(intersect) {
-        //return PropogatePhoton(scene, reflected_ray, start_reflect, vec4(reflected, 1), depth + 1);
+        //return PropogatePhoton(scene, settings, reflected_ray, start_reflect, vec4(reflected, 1), depth + 1);
       }
 
       Intersection refracted_ray;
+      CountStat(STAT_PHOTON_RAYS);
       intersect = ClosestIntersection(start_refract, vec4(refracted, 1), scene, refracted_ray);
       if(intersect) {
-        return PropogatePhoton(scene, refracted_ray, start_refract, vec4(refracted, 1), depth + 1);
+        return PropogatePhoton(scene, settings, refracted_ray, start_refract, vec4(refracted, 1), depth + 1);
       }
 
   }
@@ -312,15 +478,28 @@ Photon PropogatePhoton(Scene &scene, const Intersection& i, vec4 origin, vec4 di
   return Photon(vec3(1, 1, 1), i.position);
 }
 
-vec3 Shade(Scene &scene, const Intersection& i, vec4 origin, vec4 direction) {
-  return MainShader(scene, i, origin, direction, 0, 0);
+vec3 Shade(Scene &scene, const RenderSettings& settings, const Intersection& i, vec4 origin, vec4 direction) {
+  return MainShader(scene, settings, i, origin, direction, 0, 0);
 }
 
 
 
-void ConstructPhotonMap(Scene &scene) {
+//Builds the lookup tree over photon_map, also used for photons restored from a checkpoint
+void BuildPhotonTree() {
 
+  if(photon_tree) kd_free(photon_tree);
   photon_tree = kd_create(3);
+  for(int i = 0; i < (int)photon_map.size(); i++) {
+    const Photon& p = photon_map[i];
+    kd_insert3( photon_tree, p.position.x, p.position.y, p.position.z, 0);
+  }
+  tree_size = photon_map.size();
+
+}
+
+void ConstructPhotonMap(Scene &scene, const RenderSettings& settings) {
+
+  photon_map.clear();
 
   vec3 normal_down = vec3(0, 1, 0);
   vec3 normal_down_Nt;
@@ -331,8 +510,10 @@ void ConstructPhotonMap(Scene &scene) {
     PointLight light = scene.scene_lights[i];
     vec4 start = light.lightPos;
 
-    for(int s = 0; s < PHOTON_SAMPLES; s++) {
+    for(int s = 0; s < settings.photon_samples; s++) {
 
+        //Photons are successive samples of one pixel slot per light, so they follow the sampler's sequence
+        StartSample(0, i, s);
         vec3 sample = monteCarloSample(2);
         vec4 direction = vec4(
             sample.x * normal_down_Nb.x + sample.y * normal_down.x + sample.z * normal_down_Nt.x,
@@ -341,15 +522,12 @@ void ConstructPhotonMap(Scene &scene) {
             1);
 
         Intersection photon;
+        CountStat(STAT_PHOTON_RAYS);
         if(ClosestIntersection(start, direction, scene, photon)) {
           //if(photon.properties.refractance > 0 || photon.properties.reflectance > 0){
           if(photon.properties.refractance > 0){
 
-            Photon p = PropogatePhoton(scene, photon, start, direction, 0);
-            // photon_map.push_back(PropogatePhoton(scene, photon, start, direction));
-            // photon_tree = insert(photon_tree, vec3(p.position));
-            kd_insert3( photon_tree, p.position.x, p.position.y, p.position.z, 0);
-            tree_size++;
+            photon_map.push_back(PropogatePhoton(scene, settings, photon, start, direction, 0));
           }
         }
 
@@ -358,6 +536,7 @@ void ConstructPhotonMap(Scene &scene) {
 
   }
 
+  BuildPhotonTree();
   printf("Photon map size: %d\n", tree_size);
 
 }
@@ -1,4 +1,7 @@
+// Building with RENDER_SCREEN=0 drops SDL entirely, leaving only the headless renderer
+#ifndef RENDER_SCREEN
 #define RENDER_SCREEN 1
+#endif
 
 #include <iostream>
 #include <glm/glm.hpp>
@@ -9,28 +12,53 @@
 #endif
 
 #include "TestModelH.h"
+#include "framebuffer.h"
+#include "triplebuffer.h"
+#include "reprojection.h"
+#include "options.h"
+#include "hdr.h"
+#include "tilestream.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "sequence.h"
+#include "objloader.h"
+#include "scenefile.h"
+#include "scenedesc.h"
 #include "lodepng.h"
+#include "pngstream.h"
+#include "stats.h"
 #include <stdint.h>
 #include <omp.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <sys/wait.h>
+#include <signal.h>
 
 using namespace std;
 using glm::vec3;
 using glm::mat3;
 
-// #define SCREEN_WIDTH 160
-// #define SCREEN_HEIGHT 120
-// #define SCREEN_WIDTH 320
-// #define SCREEN_HEIGHT 240
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-#define WINDOW_WIDTH 640
-#define WINDOW_HEIGHT 480
 #define FULLSCREEN_MODE false
 
-#define DRAW_WIDTH 16
-#define DRAW_HEIGHT 12
-
-#define ANTI_ALIASING 1
+// Adaptive sampling, pixels stop once the relative error of their mean falls below the threshold
+#define MIN_SAMPLES 4
+#define ERROR_THRESHOLD 0.05f
+// The interactive view keeps refining unconverged pixels up to this many samples while the camera is still
+#define PROGRESSIVE_MAX_SAMPLES 1024
+
+// While the view is moving the internal resolution is scaled to hold --target-frame-ms,
+// full resolution resumes once the view has been still for IDLE_DELAY (ms)
+#define MIN_RESOLUTION_SCALE 0.125f
+#define IDLE_DELAY 250
+// Tile edge for distributed rendering, small enough to balance well across workers
+#define DISTRIBUTED_TILE_SIZE 32
+// Camera moves reuse the previous frame when at least this fraction of it survives reprojection
+#define REPROJECTION_MIN_VALID 0.5f
+// Loaded meshes are scaled to this size and stood in the middle of the floor
+#define MESH_SIZE 0.8f
+#define MESH_BASE vec3(0, 1, 0)
 
 struct png_obj {
   uint8_t* png_buffer;
@@ -40,56 +68,199 @@ struct png_obj {
 /* GLOBAL VARIABLES
 //System                                                    */
 int t;
-bool running = true;
+std::atomic<bool> running(true);
+int screen_width = 640;
+int screen_height = 480;
 
 //Object
 Scene scene;
 // vector<Triangle> triangles;
+std::string mesh_path;
+std::string scene_path;
+std::string bvh_cache_path;
+//Own the mappings a binary scene's mesh and a cached BVH are read from
+SceneFile scene_file;
+SceneFile bvh_file;
+//Text scene, the default one unless --scene names a file
+SceneDescription scene_description;
 
 //Camera
 float yaw = 0, pitch = 0, roll = 0;
 mat4 rotationMatrix;
 vec4 cameraPos(0, 0, -1.8, 1.0);
 float f = 1.0;
+vector<PointLight> view_lights;
+SamplerType view_sampler = SAMPLER_SOBOL;
+
+// Everything the event loop can change, handed to the render thread as one snapshot
+struct View {
+  vec4 cameraPos;
+  mat4 rotationMatrix;
+  vector<PointLight> lights;
+  SamplerType sampler;
+};
 
-int draw_x = 0, draw_y = 0;
-/* ----------------------------------------------------------------------------*/
-/* FUNCTIONS                                                                   */
+//The view currently being rendered, only touched by the rendering side
+View render_view;
+//The quality settings handed to the shaders, set before rendering starts and left alone while it runs
+RenderSettings render_settings = DEFAULT_SETTINGS;
 
-#if (!RENDER_SCREEN)
-typedef struct screen;
+Framebuffer framebuffer(0, 0);
+int pass = 0;
+//Time spent building the photon map since the last frame was reported
+double photon_seconds = 0;
+
+#if RENDER_SCREEN
+//Published by the SDL thread, picked up by the render thread whenever scene_version moves on
+std::atomic<uint32_t> scene_version(0);
+std::mutex view_mutex;
+View pending_view;
+
+std::atomic<bool> show_heatmap(false);
+TripleBuffer<uint32_t> frames;
+
+//Reduced resolution estimate shown while the camera moves
+Framebuffer preview(0, 0);
+float resolution_scale = 1.0f;
+float target_frame_time = DEFAULT_TARGET_FRAME_TIME;
+std::chrono::steady_clock::time_point last_view_change;
+
+//Primary hit positions of the full resolution framebuffer, for reuse across camera moves
+ReprojectionCache reprojection(0, 0);
+float reprojected_fraction = 0;
 #endif
+/* ----------------------------------------------------------------------------*/
+/* FUNCTIONS                                                                   */
 
 void Init();
+void LoadScene();
+void PreparePhotonMap();
+CheckpointIdentity CurrentIdentity();
 void Update();
-void Draw(screen* screen);
+void RenderImage(const RenderOptions& options, const vector<uint8_t>& resumed_rows);
+void RenderTiles(const RenderOptions& options, int frame = 0);
+void RenderCoordinator(const RenderOptions& options);
+void RenderWorker(const RenderOptions& options);
+void RenderSequence(const RenderOptions& options);
+void RenderLoop();
+void PublishView();
+View CurrentView();
+void ApplyView(const View& view);
 
 int main( int argc, char* argv[] )
 {
+    RenderOptions options;
+    if(!ParseOptions(argc, argv, options)) return 1;
+
+    //Settings in a scene description are defaults, so the command line is parsed again on top of them
+    if(options.scene.empty() || !IsSceneFile(options.scene)) {
+      bool described = options.scene.empty() ? scene_description.parse(DEFAULT_SCENE, "default scene") : scene_description.load(options.scene);
+      if(!described) return 1;
+      if(!scene_description.settings.empty()) {
+        options = RenderOptions();
+        if(!scene_description.applySettings(options) || !ParseOptions(argc, argv, options)) return 1;
+      }
+    }
+
+#if (!RENDER_SCREEN)
+    options.headless = true;
+#endif
+
+    if(options.threads > 0) omp_set_num_threads(options.threads);
+    render_settings = options.settings;
+    if(!options.stats.empty() && !OpenStats(options.stats)) return 1;
+    screen_width = options.width;
+    screen_height = options.height;
+    mesh_path = options.mesh;
+    scene_path = options.scene;
+    bvh_cache_path = options.bvh_cache;
+
+    if(!options.write_scene.empty()) {
+      LoadScene();
+      return WriteSceneFile(options.write_scene, scene, cameraPos, vec3(yaw, pitch, roll)) ? 0 : 1;
+    }
+
+    if(!options.worker.empty()) {
+      RenderWorker(options);
+      return 0;
+    }
+    if(options.coordinator_port >= 0) {
+      RenderCoordinator(options);
+      return 0;
+    }
+
+    if(options.headless && !options.sequence.empty()) {
+      RenderSequence(options);
+      return 0;
+    }
+
+    if(options.headless) {
+      //Tiled float output never holds the whole image, so it can go past what fits in memory
+      if(FormatFromPath(options.output) == IMAGE_TILED_FLOAT) {
+        if(options.resume) {
+          printf("--resume is only supported for png and pfm output\n");
+          return 1;
+        }
+        Init();
+        ApplyView(CurrentView());
+        RenderTiles(options);
+        return 0;
+      }
+
+      framebuffer = Framebuffer(screen_width, screen_height);
+      vector<uint8_t> resumed_rows;
+      if(options.resume) {
+        //The checkpoint is checked against the scene, so that is loaded first
+        LoadScene();
+        int sampler;
+        if(!LoadCheckpoint(CheckpointPath(options), framebuffer, resumed_rows, photon_map, options.spp, CurrentIdentity(), sampler)) return 1;
+        view_sampler = (SamplerType)sampler;
+        printf("Resuming with %d of %d rows done\n", (int)std::count(resumed_rows.begin(), resumed_rows.end(), 1), screen_height);
+        PreparePhotonMap();
+      } else {
+        Init();
+      }
+      ApplyView(CurrentView());
+      RenderImage(options, resumed_rows);
+      return 0;
+    }
 
 #if RENDER_SCREEN
 
-    screen *screen = InitializeSDL( SCREEN_WIDTH, SCREEN_HEIGHT, FULLSCREEN_MODE, WINDOW_WIDTH, WINDOW_HEIGHT);
+    target_frame_time = options.target_frame_time;
+    screen *screen = InitializeSDL( screen_width, screen_height, FULLSCREEN_MODE, screen_width, screen_height);
     t = SDL_GetTicks();	/*Set start value for timer.*/
     Init();
 
+    framebuffer = Framebuffer(screen_width, screen_height);
+    frames.resize(screen_width * screen_height);
+    preview = Framebuffer(screen_width, screen_height);
+    reprojection = ReprojectionCache(screen_width, screen_height);
+
     //Clear the screen
     memset(screen->buffer, 0, screen->height*screen->width*sizeof(uint32_t));
 
+    //Rendering runs on its own thread, this loop only handles input and presents finished frames
+    PublishView();
+    std::thread renderer(RenderLoop);
+
     while(running) {
-      Draw(screen);
       Update();
-      SDL_Renderframe(screen);
+      if(frames.consume()) {
+        memcpy(screen->buffer, frames.front(), screen->height*screen->width*sizeof(uint32_t));
+        SDL_Renderframe(screen);
+      } else {
+        SDL_Delay(1);
+      }
     }
 
+    renderer.join();
+
     SDL_SaveImage( screen, "screenshot.bmp" );
 
     KillSDL(screen);
-    return 0;
-
 #endif
-    Init();
-    Draw(NULL);
+    return 0;
 }
 
 // #define STAR_COUNT 1000
@@ -97,23 +268,95 @@ int main( int argc, char* argv[] )
 
 void Init() {
 
-  vector<Triangle> triangles;
-  LoadTestModel(triangles);
-  scene.scene_triangles.insert(scene.scene_triangles.end(), triangles.begin(), triangles.end());
-  injectCustom(scene);
+  LoadScene();
+  PreparePhotonMap();
+
+}
 
-  vec4 sum = vec4(0, 0, 0, 0);
-  for (int i = 0; i < (int)triangles.size(); i++) {
-    Triangle triangle = triangles[i];
-    sum += ((triangle.v0 + triangle.v1 + triangle.v2) / 3.0f);
+//Photon emission draws from the sampler too, a resumed render brings its own photons
+void PreparePhotonMap() {
+
+  SetSampler(view_sampler);
+  if(photon_map.empty()) {
+    printf("Contrusting Photon Map \n");
+    double start = omp_get_wtime();
+    ConstructPhotonMap(scene, render_settings);
+    photon_seconds += omp_get_wtime() - start;
+    printf("Constructed\n");
+  } else {
+    BuildPhotonTree();
   }
-  vec4 center = sum / ((float)triangles.size());
-  cameraPos.x = center.x;
-  cameraPos.y = center.y;
 
-  printf("Contrusting Photon Map \n");
-  ConstructPhotonMap(scene);
-  printf("Constructed\n");
+}
+
+//Geometry, materials and lights from a binary scene or the scene description, plus --mesh
+void LoadScene() {
+
+  vec3 rotation(yaw, pitch, roll);
+  if(!scene_path.empty() && IsSceneFile(scene_path)) {
+    double start = omp_get_wtime();
+    if(!scene_file.open(scene_path, scene, cameraPos, rotation)) exit(1);
+    printf("Mapped %s: %zu triangles in %f s\n", scene_path.c_str(), scene.scene_mesh.faceCount(), omp_get_wtime() - start);
+  } else {
+    if(!scene_description.build(scene, cameraPos, rotation)) exit(1);
+  }
+  if(rotation != vec3(yaw, pitch, roll)) {
+    yaw = rotation.x;
+    pitch = rotation.y;
+    roll = rotation.z;
+    UpdateRotationMatrix(pitch, yaw, roll, rotationMatrix);
+  }
+
+  if(!mesh_path.empty()) {
+    double start = omp_get_wtime();
+    size_t first_vertex = scene.scene_mesh.positions.size();
+    size_t first_face = scene.scene_mesh.faceCount();
+    scene.scene_materials.push_back(ShaderProperties(vec3(0.75f, 0.75f, 0.75f), 0.2f, 0.5f, 0.5f, 8, 0, 0, 1));
+    if(!LoadOBJ(mesh_path, scene.scene_mesh, scene.scene_materials.size() - 1)) exit(1);
+    PlaceMesh(scene.scene_mesh, first_vertex, MESH_BASE, MESH_SIZE);
+    printf("Loaded %s: %zu vertices, %zu triangles in %f s\n", mesh_path.c_str(),
+      scene.scene_mesh.positions.size() - first_vertex, scene.scene_mesh.faceCount() - first_face, omp_get_wtime() - start);
+  }
+  view_lights = scene.scene_lights;
+
+  //A BVH that came with --scene is used as is, otherwise try the cache before building one
+  if(!scene.scene_bvh.covers(scene.scene_mesh)) {
+    double start = omp_get_wtime();
+    bool cached = false;
+    if(!bvh_cache_path.empty() && bvh_file.openBVH(bvh_cache_path, scene.scene_bvh)) {
+      cached = scene.scene_bvh.covers(scene.scene_mesh) && scene.scene_bvh.info.geometry_hash == GeometryHash(scene.scene_mesh);
+      if(!cached) {
+        printf("%s was built for different geometry, rebuilding\n", bvh_cache_path.c_str());
+        bvh_file.close();
+      }
+    }
+    if(!cached) {
+      scene.scene_bvh.build(scene.scene_mesh);
+      if(!bvh_cache_path.empty()) WriteBVHFile(bvh_cache_path, scene.scene_bvh);
+    }
+    printf("%s BVH: %zu nodes for %zu triangles in %f s\n", cached ? "Loaded" : "Built",
+      scene.scene_bvh.nodes.size(), scene.scene_mesh.faceCount(), omp_get_wtime() - start);
+  }
+
+  //Instanced meshes each get their own BVH, then one over the placed copies ties them together
+  if(!scene.scene_instances.empty()) {
+    double start = omp_get_wtime();
+    size_t faces = 0;
+    for(size_t i = 0; i < scene.scene_prototypes.size(); i++) {
+      Prototype& prototype = scene.scene_prototypes[i];
+      if(!prototype.bvh.covers(prototype.mesh)) prototype.bvh.build(prototype.mesh);
+    }
+    if(scene.scene_instance_bvh.info.primitive_count != scene.scene_instances.size()) {
+      BuildInstanceBVH(scene.scene_prototypes, scene.scene_instances, scene.scene_instance_bvh);
+    }
+    for(size_t i = 0; i < scene.scene_instances.size(); i++) {
+      faces += scene.scene_prototypes[scene.scene_instances[i].prototype].mesh.faceCount();
+    }
+    printf("Instanced %zu copies of %zu meshes, %zu triangles, in %f s\n", scene.scene_instances.size(),
+      scene.scene_prototypes.size(), faces, omp_get_wtime() - start);
+  }
+  if(!scene.scene_spheres.empty()) UpdateSphereBVH(scene);
+  ClassifyMaterials(scene);
 
 }
 
@@ -126,7 +369,7 @@ float max(float a, float b) {
 
 void PutPixelBCP(png_obj* png, int x, int y, glm::vec3 colour)
 {
-  if(x<0 || x>=SCREEN_WIDTH || y<0 || y>=SCREEN_HEIGHT)
+  if(x<0 || x>=screen_width || y<0 || y>=screen_height)
     {
       std::cout << "apa" << std::endl;
       return;
@@ -135,7 +378,7 @@ void PutPixelBCP(png_obj* png, int x, int y, glm::vec3 colour)
   uint32_t g = uint32_t( glm::clamp( 255*colour.g, 0.f, 255.f ) );
   uint32_t b = uint32_t( glm::clamp( 255*colour.b, 0.f, 255.f ) );
 
-  int NewPos = (y * SCREEN_WIDTH + x) * 4;
+  int NewPos = (y * screen_width + x) * 4;
 
   png->png_buffer[NewPos + 0] = r; //B is offset 2
   png->png_buffer[NewPos + 1] = g; //G is offset 1
@@ -144,90 +387,658 @@ void PutPixelBCP(png_obj* png, int x, int y, glm::vec3 colour)
 }
 
 
-/*Place your drawing here*/
-void Draw(screen* screen)
+//The scene and camera as loaded and the render settings, checkpoints are tied to them
+CheckpointIdentity CurrentIdentity()
 {
+  CheckpointIdentity identity;
+  identity.scene_hash = SceneHash(scene);
+  identity.camera_hash = CameraHash(cameraPos, rotationMatrix);
+  identity.settings = render_settings;
+  return identity;
+}
 
-  float aspect_ratio = ((float)SCREEN_HEIGHT) / ((float)SCREEN_WIDTH);
-  const float samples = ANTI_ALIASING * ANTI_ALIASING;
-  const float x_change = (2.0 / ((float)SCREEN_WIDTH)) / ANTI_ALIASING;
-  const float y_change = ((2.0 / ((float)SCREEN_HEIGHT)) / ANTI_ALIASING) * aspect_ratio;
+View CurrentView()
+{
+  View view;
+  view.cameraPos = cameraPos;
+  view.rotationMatrix = rotationMatrix;
+  view.lights = view_lights;
+  view.sampler = view_sampler;
+  return view;
+}
 
-  int draw_height = DRAW_HEIGHT;
-  int draw_width = DRAW_WIDTH;
+//Must only run while no samples are being traced
+void ApplyView(const View& view)
+{
+  render_view = view;
+  scene.scene_lights = view.lights;
+  SetSampler(view.sampler);
+}
 
+//Takes the counters traced since the last report, with the photon map time spent since then
+FrameStats CollectFrameStats(int frame, double render_seconds, double encode_seconds, int spp)
+{
+  FrameStats stats;
+  stats.frame = frame;
+  stats.width = screen_width;
+  stats.height = screen_height;
+  stats.spp = spp;
+  stats.threads = omp_get_max_threads();
+  stats.photon_seconds = photon_seconds;
+  stats.render_seconds = render_seconds;
+  stats.encode_seconds = encode_seconds;
+  TakeStats(stats.counts);
+  photon_seconds = 0;
+  return stats;
+}
 
-#if (!RENDER_SCREEN)
-  draw_height = SCREEN_HEIGHT;
-  draw_width = SCREEN_WIDTH;
-  png_obj png;
-  png.png_buffer = (uint8_t*)malloc(sizeof(uint8_t) * SCREEN_WIDTH * SCREEN_HEIGHT * 4);
-#endif
+//Optionally reports the primary hit in position, w = 0 on a miss
+vec3 TraceSample(float xDir, float yDir, vec4* position = NULL)
+{
+  vec4 direction = render_view.rotationMatrix * vec4(xDir, yDir, f, 1.0);
+  Intersection closest;
+  CountStat(STAT_PRIMARY_RAYS);
+  bool doesIntersect = ClosestIntersection(render_view.cameraPos, direction, scene, closest);
+  if(position) {
+    *position = doesIntersect ? vec4(vec3(closest.position), 1) : vec4(0, 0, 0, 0);
+  }
+  if(doesIntersect) {
+    return Shade(scene, render_settings, closest, render_view.cameraPos, direction);
+  }
+  return vec3(0, 0, 0);
+}
 
-  #pragma omp parallel for
-  for (int y = draw_y; y < draw_y + draw_height; y++) {
+//Adds one jittered sample to the running estimate of pixel (x, y) of a width x height image.
+//If position is given it receives the primary hit of the pixel's first sample.
+void SamplePixel(int x, int y, int width, int height, PixelStats& pixel, vec4* position = NULL)
+{
+  float aspect_ratio = ((float)height) / ((float)width);
+  const float x_change = 2.0 / ((float)width);
+  const float y_change = (2.0 / ((float)height)) * aspect_ratio;
 
-      float yDir = (((2 * y) / ((float)SCREEN_HEIGHT)) - 1.0) * aspect_ratio;
+  float xDir = ((2 * x) / ((float)width)) - 1.0;
+  float yDir = (((2 * y) / ((float)height)) - 1.0) * aspect_ratio;
 
-      #pragma omp simd
-      for (int x = draw_x; x < draw_x + draw_width; x++) {
+  StartSample(x, y, pixel.samples);
+  float jitter_x = NextSample();
+  float jitter_y = NextSample();
+  pixel.add(TraceSample(xDir + (jitter_x * x_change), yDir + (jitter_y * y_change), pixel.samples == 0 ? position : NULL));
+}
 
-        float xDir = ((2 * x) / ((float)SCREEN_WIDTH)) - 1.0;
+#if RENDER_SCREEN
 
-        vec3 colour = vec3(0, 0, 0);
-        for(float xA = 0; xA < ANTI_ALIASING; xA++) {
-          for(float yA = 0; yA < ANTI_ALIASING; yA++) {
-            vec4 direction = rotationMatrix * vec4(xDir + (xA*x_change), yDir + (yA*y_change), f, 1.0);
-            Intersection closest;
-            bool doesIntersect = ClosestIntersection(cameraPos, direction, scene, closest);
-            if(doesIntersect) {
-              colour += Shade(scene, closest, cameraPos, direction);
-            }
-          }
-        }
+void PublishView()
+{
+  {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    pending_view = CurrentView();
+  }
+  scene_version.fetch_add(1, std::memory_order_release);
+}
 
-#if RENDER_SCREEN
-          PutPixelSDL(screen, x, y, (colour / samples));
-#endif
+//Adds a sample to every unconverged pixel, or only to empty ones when filling reprojection holes,
+//and writes the running estimate into target.
+//Returns false if a newer view was published part way through, the pass is then discarded.
+bool DrawPass(uint32_t* target, uint32_t version, bool holes_only)
+{
+  bool refined = false;
+  bool interrupted = false;
+
+  #pragma omp parallel for schedule(dynamic) reduction(||:refined, interrupted)
+  for (int y = 0; y < screen_height; y++) {
+    if(scene_version.load(std::memory_order_relaxed) != version) {
+      interrupted = true;
+      continue;
+    }
 
-#if (!RENDER_SCREEN)
-          PutPixelBCP(&png, x, y, (colour / samples));
-#endif
+    for (int x = 0; x < screen_width; x++) {
 
-        // vec4 direction = rotationMatrix * vec4(xDir, yDir, f, 1.0);
-        //
-        // Intersection closest;
-        // bool doesIntersect = ClosestIntersection(cameraPos, direction, scene, closest);
-        //
-        // if (doesIntersect) {
-        //   PutPixelSDL(screen, x, y, Shade(scene, closest, cameraPos, direction));
-        // }
+      PixelStats &pixel = framebuffer.at(x, y);
+      bool wanted = holes_only ? pixel.samples == 0 :
+        (pixel.samples < PROGRESSIVE_MAX_SAMPLES && !pixel.converged(MIN_SAMPLES, ERROR_THRESHOLD));
+      if(wanted) {
+        SamplePixel(x, y, screen_width, screen_height, pixel, &reprojection.positions[(y * screen_width) + x]);
+        refined = true;
+      }
 
+      vec3 heat = HeatmapColour(pixel.samples, 1, PROGRESSIVE_MAX_SAMPLES);
+      target[(y * screen_width) + x] = PackARGB(show_heatmap ? heat : pixel.mean());
     }
   }
 
-#if (!RENDER_SCREEN)
-  std::vector<std::uint8_t> ImageBuffer;
-  lodepng::encode(ImageBuffer, png_buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
-  lodepng::save_file(ImageBuffer, "render_64.png");
-#endif
+  if(interrupted) return false;
 
-#if RENDER_SCREEN
-  draw_x += DRAW_WIDTH;
-  if(draw_x >= SCREEN_WIDTH) {
-    draw_x = 0;
-    draw_y += DRAW_HEIGHT;
-  }
-  if(draw_y >= SCREEN_HEIGHT) {
-    draw_y = 0;
+  if(refined && !holes_only) {
+    pass++;
     int t2 = SDL_GetTicks();
     float dt = float(t2-t);
     t = t2;
 
-    printf("Frame time: %f \n", dt);
+    FrameStats stats = CollectFrameStats(pass, dt / 1000.0, 0, PROGRESSIVE_MAX_SAMPLES);
+    uint64_t rays = TracedRays(stats.counts) - stats.counts[STAT_PHOTON_RAYS];
+    printf("Frame time: %f (pass %d, %.2f Mrays/s)\n", dt, pass, dt > 0 ? rays / (dt * 1000.0) : 0.0);
+    WriteStats(stats);
+  } else if(!refined) {
+    //Everything has converged, only keep republishing so the heatmap toggle still shows up
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return true;
+}
+
+//One sample per pixel at the current resolution scale, upsampled to the window.
+//The scale is then steered so the next pass lands near target_frame_time.
+void DrawPreviewPass(uint32_t* target)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  int width = std::max(1, (int)(screen_width * resolution_scale));
+  int height = std::max(1, (int)(screen_height * resolution_scale));
+  if(preview.width != width || preview.height != height) {
+    preview = Framebuffer(width, height);
   }
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      SamplePixel(x, y, width, height, preview.at(x, y));
+    }
+  }
+
+  #pragma omp parallel for
+  for (int y = 0; y < screen_height; y++) {
+    float v = (y + 0.5f) / screen_height;
+    for (int x = 0; x < screen_width; x++) {
+      target[(y * screen_width) + x] = PackARGB(preview.sampleBilinear((x + 0.5f) / screen_width, v));
+    }
+  }
+
+  float dt = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  //Cost goes with pixel count, i.e. the square of the scale, damped to avoid oscillating
+  float ideal = resolution_scale * sqrtf(target_frame_time / std::max(dt, 1.f));
+  resolution_scale = glm::clamp((0.5f * resolution_scale) + (0.5f * ideal), MIN_RESOLUTION_SCALE, 1.f);
+}
+
+void RenderLoop()
+{
+  const uint32_t scene_version_none = scene_version.load(std::memory_order_acquire) - 1;
+  uint32_t drawn_version = scene_version_none;
+
+  while(running) {
+    uint32_t version = scene_version.load(std::memory_order_acquire);
+    if(version != drawn_version) {
+      View previous = render_view;
+      {
+        std::lock_guard<std::mutex> lock(view_mutex);
+        ApplyView(pending_view);
+      }
+
+      //Radiance stays valid across pure camera moves, anything else starts over
+      bool lighting_unchanged = previous.sampler == render_view.sampler && previous.lights.size() == render_view.lights.size();
+      for (int i = 0; lighting_unchanged && i < (int)previous.lights.size(); i++) {
+        lighting_unchanged = previous.lights[i].lightPos == render_view.lights[i].lightPos;
+      }
+
+      reprojected_fraction = 0;
+      if(lighting_unchanged && drawn_version != scene_version_none) {
+        float aspect_ratio = ((float)screen_height) / ((float)screen_width);
+        reprojected_fraction = Reproject(framebuffer, reprojection, render_view.cameraPos, render_view.rotationMatrix, f,
+          [aspect_ratio](int x, int y, vec4& hit) {
+            float xDir = ((2 * (x + 0.5f)) / ((float)screen_width)) - 1.0;
+            float yDir = (((2 * (y + 0.5f)) / ((float)screen_height)) - 1.0) * aspect_ratio;
+            vec4 direction = render_view.rotationMatrix * vec4(xDir, yDir, f, 1.0);
+            Intersection closest;
+            CountStat(STAT_PRIMARY_RAYS);
+            if(!ClosestIntersection(render_view.cameraPos, direction, scene, closest)) return false;
+            hit = vec4(vec3(closest.position), 1);
+            return true;
+          });
+      } else {
+        framebuffer.clear();
+        reprojection.clear();
+      }
+
+      preview.clear();
+      pass = 0;
+      drawn_version = version;
+      last_view_change = std::chrono::steady_clock::now();
+    }
+
+    //While the camera moves either fill the holes left by reprojection or fall back to a cheap
+    //preview, full resolution refinement resumes once it settles
+    bool moving = (std::chrono::steady_clock::now() - last_view_change) < std::chrono::milliseconds(IDLE_DELAY);
+    if(moving && reprojected_fraction < REPROJECTION_MIN_VALID) {
+      DrawPreviewPass(frames.back());
+      frames.publish();
+    } else if(DrawPass(frames.back(), version, moving)) {
+      frames.publish();
+    }
+  }
+}
+
 #endif
 
+//Keeps jittering inside the pixel until its estimate settles or the budget runs out
+void ConvergePixel(int x, int y, PixelStats& pixel, int min_samples, int max_samples)
+{
+  pixel = PixelStats();
+  while(pixel.samples < max_samples && !pixel.converged(min_samples, ERROR_THRESHOLD)) {
+    SamplePixel(x, y, screen_width, screen_height, pixel);
+  }
+}
+
+//Output files of a headless render, plus the samples per pixel heatmap. Rows are handed over with
+//finishRow() as soon as they are final, from any thread; png output is tone mapped and compressed
+//band by band from there while the rest of the image is still rendering.
+class ImageOutput {
+public:
+  ImageOutput(const RenderOptions& options, const Framebuffer& source)
+    : options(options), source(source), format(FormatFromPath(options.output)),
+      min_samples(std::min(MIN_SAMPLES, options.spp)), heatmap_path(HeatmapPath(options.output))
+  {
+    PNGCompression compression = (PNGCompression)options.png_level;
+    heatmap.resize(source.width * source.height * 4);
+    if(!heatmap_png.open(heatmap_path, heatmap.data(), source.width, source.height, compression)) {
+      printf("Failed to open %s\n", heatmap_path.c_str());
+      exit(1);
+    }
+
+    if(format == IMAGE_PNG) {
+      rgb.resize(source.width * source.height * 3);
+      image.resize(source.width * source.height * 4);
+      if(!png.open(options.output, image.data(), source.width, source.height, compression)) {
+        printf("Failed to open %s\n", options.output.c_str());
+        exit(1);
+      }
+    }
+  }
+
+  void finishRow(int y) {
+    png_obj heat = { heatmap.data() };
+    for (int x = 0; x < source.width; x++) {
+      PutPixelBCP(&heat, x, y, HeatmapColour(source.pixels[(y * source.width) + x].samples, min_samples, options.spp));
+    }
+
+    if(format == IMAGE_PNG) {
+      size_t row = (size_t)y * source.width;
+      source.resolve(&rgb[row * 3], row, source.width);
+      Tonemap(&rgb[row * 3], &image[row * 4], source.width, options.exposure, options.tonemap);
+      png.rowDone(y);
+    }
+    heatmap_png.rowDone(y);
+  }
+
+  //Float formats stream the linear estimate straight out once everything is in. Exits on failure.
+  void close() {
+    auto mean = [this](int x, int y) { return source.pixels[(y * source.width) + x].mean(); };
+    unsigned error = 0;
+    if(format == IMAGE_PFM) {
+      if(!WritePFM(options.output, source.width, source.height, mean)) error = 79;
+    } else if(format == IMAGE_TILED_FLOAT) {
+      if(!WriteTiledFloat(options.output, source.width, source.height, TILED_FLOAT_TILE_SIZE, mean)) error = 79;
+    } else {
+      error = png.close();
+    }
+
+    if(error) {
+      printf("Failed to write %s: %s\n", options.output.c_str(), lodepng_error_text(error));
+      exit(1);
+    }
+    error = heatmap_png.close();
+    if(error) {
+      printf("Failed to write %s: %s\n", heatmap_path.c_str(), lodepng_error_text(error));
+      exit(1);
+    }
+    printf("Wrote %s and %s\n", options.output.c_str(), heatmap_path.c_str());
+  }
+
+private:
+  const RenderOptions& options;
+  const Framebuffer& source;
+  ImageFormat format;
+  int min_samples;
+
+  std::string heatmap_path;
+  std::vector<uint8_t> heatmap;
+  PNGStream heatmap_png;
+
+  std::vector<float> rgb;
+  std::vector<uint8_t> image;
+  PNGStream png;
+};
+
+//Renders the whole image to options.output. Finished rows are checkpointed in the background,
+//rows set in resumed_rows are already in the framebuffer.
+void RenderImage(const RenderOptions& options, const vector<uint8_t>& resumed_rows)
+{
+  double start = omp_get_wtime();
+  int min_samples = std::min(MIN_SAMPLES, options.spp);
+  ImageOutput output(options, framebuffer);
+
+  std::string checkpoint_path = CheckpointPath(options);
+  Checkpointer checkpoint(checkpoint_path, framebuffer, photon_map, options.spp, render_view.sampler, CurrentIdentity());
+  checkpoint.start(options.checkpoint_interval);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int y = 0; y < screen_height; y++) {
+    bool resumed = !resumed_rows.empty() && resumed_rows[y];
+    for (int x = 0; x < screen_width; x++) {
+      if(!resumed) ConvergePixel(x, y, framebuffer.at(x, y), min_samples, options.spp);
+    }
+    checkpoint.markRow(y);
+    output.finishRow(y);
+  }
+
+  checkpoint.stop();
+  double render_seconds = omp_get_wtime() - start;
+  printf("Render time: %f s\n", render_seconds);
+  FrameStats stats = CollectFrameStats(0, render_seconds, 0, options.spp);
+  double encode_start = omp_get_wtime();
+  output.close();
+  stats.encode_seconds = omp_get_wtime() - encode_start;
+  WriteStats(stats);
+
+  //Only needed until the image is safely on disk
+  remove(checkpoint_path.c_str());
+}
+
+//Renders straight into a .tfl file one tile at a time. Each thread owns a single tile buffer and finished
+//tiles queue for a writer thread, so memory goes with tile size times thread count, not image size.
+//There is no heatmap in this mode since it would need a full image buffer of its own.
+void RenderTiles(const RenderOptions& options, int frame)
+{
+  double start = omp_get_wtime();
+  int min_samples = std::min(MIN_SAMPLES, options.spp);
+  const int tile_size = TILED_FLOAT_TILE_SIZE;
+  int tiles_x = (screen_width + tile_size - 1) / tile_size;
+  int tiles_y = (screen_height + tile_size - 1) / tile_size;
+  int tile_count = tiles_x * tiles_y;
+
+  TileWriter writer;
+  if(!writer.open(options.output, screen_width, screen_height, tile_size, 2 * omp_get_max_threads())) {
+    printf("Failed to open %s\n", options.output.c_str());
+    exit(1);
+  }
+
+  int finished = 0;
+
+  #pragma omp parallel
+  {
+    Framebuffer tile(tile_size, tile_size);
+    std::vector<float> data;
+
+    #pragma omp for schedule(dynamic)
+    for (int i = 0; i < tile_count; i++) {
+      int x0 = (i % tiles_x) * tile_size;
+      int y0 = (i / tiles_x) * tile_size;
+      int x1 = std::min(x0 + tile_size, screen_width);
+      int y1 = std::min(y0 + tile_size, screen_height);
+
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+          ConvergePixel(x, y, tile.at(x - x0, y - y0), min_samples, options.spp);
+        }
+      }
+
+      GatherTile(data, i % tiles_x, i / tiles_x, tile_size, screen_width, screen_height,
+        [&](int x, int y) { return tile.at(x - x0, y - y0).mean(); });
+      writer.push(i, data);
+
+      int done;
+      #pragma omp atomic capture
+      done = ++finished;
+      if(done % std::max(1, tile_count / 20) == 0) printf("%d/%d tiles\n", done, tile_count);
+    }
+  }
+
+  //Tiles are written as they finish, only the tail of the queue is left to encode
+  double render_seconds = omp_get_wtime() - start;
+  FrameStats stats = CollectFrameStats(frame, render_seconds, 0, options.spp);
+  if(!writer.close()) {
+    printf("Failed to write %s\n", options.output.c_str());
+    exit(1);
+  }
+  stats.encode_seconds = omp_get_wtime() - start - render_seconds;
+  WriteStats(stats);
+  printf("Render time: %f s\n", render_seconds);
+  printf("Wrote %s\n", options.output.c_str());
+}
+
+//Hands the frame out to worker processes tile by tile and writes the result as RenderImage would.
+//Only the output is held here, the scene is never loaded by the coordinator.
+void RenderCoordinator(const RenderOptions& options)
+{
+  double start = omp_get_wtime();
+  int port = options.coordinator_port;
+  int listen_fd = ListenOn(port);
+  if(listen_fd < 0) {
+    printf("Cannot listen on port %d\n", options.coordinator_port);
+    exit(1);
+  }
+  printf("Coordinator listening on port %d\n", port);
+
+  //Local workers split the threads between them rather than each taking the whole machine
+  std::vector<pid_t> children;
+  std::string endpoint = "127.0.0.1:" + std::to_string(port);
+  std::string threads = std::to_string(std::max(1, omp_get_max_threads() / std::max(1, options.spawn_workers)));
+  for (int i = 0; i < options.spawn_workers; i++) {
+    pid_t pid = fork();
+    if(pid == 0) {
+      close(listen_fd);
+      std::vector<const char*> args = { "skeleton", "--worker", endpoint.c_str(), "--threads", threads.c_str() };
+      if(!options.scene.empty()) args.insert(args.end(), { "--scene", options.scene.c_str() });
+      if(!options.mesh.empty()) args.insert(args.end(), { "--mesh", options.mesh.c_str() });
+      if(!options.bvh_cache.empty()) args.insert(args.end(), { "--bvh-cache", options.bvh_cache.c_str() });
+      args.push_back(NULL);
+      execv("/proc/self/exe", (char* const*)args.data());
+      perror("execv");
+      _exit(1);
+    }
+    if(pid > 0) children.push_back(pid);
+  }
+
+  framebuffer = Framebuffer(screen_width, screen_height);
+  ImageOutput output(options, framebuffer);
+
+  const int tile_size = DISTRIBUTED_TILE_SIZE;
+  int tiles_x = (screen_width + tile_size - 1) / tile_size;
+  int tiles_y = (screen_height + tile_size - 1) / tile_size;
+  std::vector<int> unfinished(tiles_y, tiles_x);
+
+  JobMessage job = { (uint32_t)screen_width, (uint32_t)screen_height, (uint32_t)options.spp, (uint32_t)view_sampler, (uint32_t)tile_size, options.settings };
+  Coordinator coordinator(listen_fd, job, tiles_x * tiles_y, tile_size * tile_size * sizeof(PixelStats), options.tile_timeout, children);
+
+  bool complete = coordinator.run([&](int index, const uint8_t* payload) {
+    const PixelStats* tile = (const PixelStats*)payload;
+    int x0 = (index % tiles_x) * tile_size;
+    int y0 = (index / tiles_x) * tile_size;
+    int y1 = std::min(y0 + tile_size, screen_height);
+    int width = std::min(tile_size, screen_width - x0);
+    for (int y = y0; y < y1; y++) {
+      memcpy(&framebuffer.at(x0, y), &tile[(y - y0) * tile_size], width * sizeof(PixelStats));
+    }
+
+    //A row of tiles completes a band of image rows for the output
+    if(--unfinished[index / tiles_x] == 0) {
+      for (int y = y0; y < y1; y++) output.finishRow(y);
+    }
+  });
+  close(listen_fd);
+
+  //Children still running when it gives up have stalled, they may not even respond to SIGTERM
+  if(!complete) {
+    for (size_t i = 0; i < children.size(); i++) kill(children[i], SIGKILL);
+    for (size_t i = 0; i < children.size(); i++) waitpid(children[i], NULL, 0);
+    exit(1);
+  }
+
+  printf("Render time: %f s\n", omp_get_wtime() - start);
+  output.close();
+
+  for (size_t i = 0; i < children.size(); i++) waitpid(children[i], NULL, 0);
+}
+
+//Loads the scene and photon map once, then renders whatever tiles the coordinator sends
+void RenderWorker(const RenderOptions& options)
+{
+  Framebuffer tile(0, 0);
+  int max_samples = 0;
+  double render_seconds = 0;
+
+  bool ok = RunWorker(options.worker,
+    [&](const JobMessage& job) {
+      screen_width = job.width;
+      screen_height = job.height;
+      max_samples = job.max_samples;
+      view_sampler = (SamplerType)job.sampler;
+      tile = Framebuffer(job.tile_size, job.tile_size);
+      render_settings = job.settings;
+      Init();
+      ApplyView(CurrentView());
+    },
+    [&](int index, std::vector<uint8_t>& result) {
+      int tiles_x = (screen_width + tile.width - 1) / tile.width;
+      int x0 = (index % tiles_x) * tile.width;
+      int y0 = (index / tiles_x) * tile.height;
+      int x1 = std::min(x0 + tile.width, screen_width);
+      int y1 = std::min(y0 + tile.height, screen_height);
+      int min_samples = std::min(MIN_SAMPLES, max_samples);
+      double start = omp_get_wtime();
+
+      tile.clear();
+      #pragma omp parallel for schedule(dynamic)
+      for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+          ConvergePixel(x, y, tile.at(x - x0, y - y0), min_samples, max_samples);
+        }
+      }
+
+      render_seconds += omp_get_wtime() - start;
+
+      const uint8_t* bytes = (const uint8_t*)tile.pixels.data();
+      result.assign(bytes, bytes + (tile.pixels.size() * sizeof(PixelStats)));
+    });
+
+  if(!ok) exit(1);
+  //Only this worker's share of the frame
+  WriteStats(CollectFrameStats(0, render_seconds, 0, max_samples));
+}
+
+//Renders every frame of a keyframed sequence in one process. The scene is loaded once and the photon map
+//is only rebuilt when a light has moved. Frames alternate between two framebuffers so that frame k is
+//tone mapped, encoded and written on its own thread while frame k + 1 renders.
+void RenderSequence(const RenderOptions& options)
+{
+  Sequence sequence;
+  if(!sequence.load(options.sequence)) exit(1);
+
+  Init();
+  if(sequence.lights.size() > view_lights.size()) {
+    printf("Sequence animates light %d but the scene only has %d\n", (int)sequence.lights.size() - 1, (int)view_lights.size());
+    exit(1);
+  }
+  if(sequence.spheres.size() > scene.scene_spheres.size()) {
+    printf("Sequence animates sphere %d but the scene only has %d\n", (int)sequence.spheres.size() - 1, (int)scene.scene_spheres.size());
+    exit(1);
+  }
+  int refits = 0, rebuilds = 0;
+
+  bool tiled = FormatFromPath(options.output) == IMAGE_TILED_FLOAT;
+  int min_samples = std::min(MIN_SAMPLES, options.spp);
+  Framebuffer buffers[2] = { Framebuffer(0, 0), Framebuffer(0, 0) };
+  if(!tiled) {
+    buffers[0] = Framebuffer(screen_width, screen_height);
+    buffers[1] = Framebuffer(screen_width, screen_height);
+  }
+  RenderOptions frame_options[2] = { options, options };
+  //A frame's summary is written once its writer has finished and the encode time is known
+  FrameStats frame_stats[2];
+  std::thread writer;
+  double start = omp_get_wtime();
+
+  for (int frame = 0; frame < sequence.frames; frame++) {
+    vec3 position, rotation;
+    if(sequence.cameraAt(frame, position, rotation)) {
+      cameraPos = vec4(position, 1);
+      yaw = rotation.x;
+      pitch = rotation.y;
+      roll = rotation.z;
+      UpdateRotationMatrix(pitch, yaw, roll, rotationMatrix);
+    }
+
+    bool lights_moved = false;
+    for (int i = 0; i < (int)view_lights.size(); i++) {
+      vec3 light_position;
+      if(sequence.lightAt(i, frame, light_position) && vec4(light_position, 1) != view_lights[i].lightPos) {
+        view_lights[i].lightPos = vec4(light_position, 1);
+        lights_moved = true;
+      }
+    }
+
+    //Moved spheres keep their BVH and only have its boxes refitted, unless that has worn the tree out
+    bool spheres_moved = false;
+    for (int i = 0; i < (int)sequence.spheres.size(); i++) {
+      vec3 sphere_position;
+      if(sequence.sphereAt(i, frame, sphere_position) && vec4(sphere_position, 1) != scene.scene_spheres[i].origin) {
+        scene.scene_spheres[i].origin = vec4(sphere_position, 1);
+        spheres_moved = true;
+      }
+    }
+    if(spheres_moved) {
+      if(UpdateSphereBVH(scene)) refits++;
+      else rebuilds++;
+    }
+
+    ApplyView(CurrentView());
+    //Caustics hang off the light and sphere positions, everything else about the scene stays as loaded
+    if(lights_moved || spheres_moved) {
+      double photon_start = omp_get_wtime();
+      ConstructPhotonMap(scene, render_settings);
+      photon_seconds += omp_get_wtime() - photon_start;
+    }
+
+    RenderOptions& frame_option = frame_options[frame % 2];
+    frame_option.output = FramePath(options.output, frame);
+    printf("Frame %d/%d -> %s\n", frame + 1, sequence.frames, frame_option.output.c_str());
+
+    if(tiled) {
+      RenderTiles(frame_option, frame);
+      continue;
+    }
+
+    Framebuffer& target = buffers[frame % 2];
+    double render_start = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < screen_height; y++) {
+      for (int x = 0; x < screen_width; x++) {
+        ConvergePixel(x, y, target.at(x, y), min_samples, options.spp);
+      }
+    }
+
+    FrameStats& stats = frame_stats[frame % 2];
+    stats = CollectFrameStats(frame, omp_get_wtime() - render_start, 0, options.spp);
+
+    //The previous frame's writer has to finish before its buffer comes round again
+    if(writer.joinable()) {
+      writer.join();
+      WriteStats(frame_stats[(frame + 1) % 2]);
+    }
+    const Framebuffer& finished = target;
+    writer = std::thread([&frame_option, &finished, &stats]() {
+      double encode_start = omp_get_wtime();
+      ImageOutput output(frame_option, finished);
+      for (int y = 0; y < finished.height; y++) output.finishRow(y);
+      output.close();
+      stats.encode_seconds = omp_get_wtime() - encode_start;
+    });
+  }
+
+  if(writer.joinable()) {
+    writer.join();
+    WriteStats(frame_stats[(sequence.frames - 1) % 2]);
+  }
+  if(refits + rebuilds > 0) printf("Sphere BVH: %d refits, %d rebuilds\n", refits, rebuilds);
+  printf("Sequence time: %f s\n", omp_get_wtime() - start);
 }
 
 void updateRotationMatrix(){
@@ -243,6 +1054,11 @@ void Update()
 {
   /* Compute frame time */
 
+  vec4 previous_camera = cameraPos;
+  mat4 previous_rotation = rotationMatrix;
+  vec4 previous_light = view_lights[0].lightPos;
+  SamplerType previous_sampler = view_sampler;
+
   SDL_Event e;
   while (SDL_PollEvent(&e)) {
 
@@ -256,6 +1072,15 @@ void Update()
           running = false;
           break;
 
+        case SDLK_h:
+          show_heatmap = !show_heatmap;
+          break;
+
+        case SDLK_n:
+          view_sampler = (SamplerType)((view_sampler + 1) % SAMPLER_COUNT);
+          printf("Sampler: %s\n", SAMPLER_NAMES[view_sampler]);
+          break;
+
         case SDLK_i:
           cameraPos.z += speed;
             break;
@@ -311,27 +1136,27 @@ void Update()
           break;
 
         case SDLK_w:
-          scene.scene_lights[0].lightPos.z += speed;
+          view_lights[0].lightPos.z += speed;
           break;
 
         case SDLK_s:
-          scene.scene_lights[0].lightPos.z -= speed;
+          view_lights[0].lightPos.z -= speed;
           break;
 
         case SDLK_d:
-          scene.scene_lights[0].lightPos.x += speed;
+          view_lights[0].lightPos.x += speed;
           break;
 
         case SDLK_a:
-          scene.scene_lights[0].lightPos.x -= speed;
+          view_lights[0].lightPos.x -= speed;
           break;
 
         case SDLK_z:
-          scene.scene_lights[0].lightPos.y += speed;
+          view_lights[0].lightPos.y += speed;
           break;
 
         case SDLK_q:
-          scene.scene_lights[0].lightPos.y -= speed;
+          view_lights[0].lightPos.y -= speed;
           break;
 
       }
@@ -344,5 +1169,11 @@ void Update()
     }
 
   }
+
+  //Accumulated samples are only valid for the view they were taken from
+  if(cameraPos != previous_camera || rotationMatrix != previous_rotation ||
+     view_lights[0].lightPos != previous_light || view_sampler != previous_sampler) {
+    PublishView();
+  }
 }
 #endif
@@ -0,0 +1,164 @@
+#ifndef SPHEREPACK_H
+#define SPHEREPACK_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <math.h>
+#include <stdint.h>
+#include "bvh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SPHERE_AVX2 1
+#else
+#define SPHERE_AVX2 0
+#endif
+
+using glm::vec3;
+
+// Spheres for intersection, as separate arrays of centre coordinates and squared radii laid out in the order
+// of the sphere BVH's primitives, so every leaf is one contiguous run. Runs are tested against a ray eight
+// spheres at a time with AVX2 on CPUs that have it, picked at run time so the build needs no extra flags,
+// and one sphere at a time with the same float operations otherwise, so both give the same distances. Only
+// distances are worked out here, the caller finds position, normal and material for the one sphere that wins.
+//
+// The arrays run SPHERE_LANES past the last sphere with spheres that are never hit, so the last block of a
+// leaf can always be loaded whole.
+
+const int SPHERE_LANES = 8;
+// Sphere BVH leaves are one block
+const int SPHERE_LEAF_SIZE = SPHERE_LANES;
+
+// Distance along direction to the sphere, or negative if it is missed or behind. a is dot(direction, direction).
+// Uses the form of the quadratic that does not cancel for rays starting on the surface.
+inline float SphereDistance(const vec3& origin, const vec3& direction, float a, float x, float y, float z, float radius2) {
+  float lx = origin.x - x;
+  float ly = origin.y - y;
+  float lz = origin.z - z;
+  float h = (direction.x * lx) + (direction.y * ly) + (direction.z * lz);
+  float c = ((lx * lx) + (ly * ly) + (lz * lz)) - radius2;
+  float discriminant = (h * h) - (a * c);
+  if(!(discriminant >= 0)) return -1;
+  float q = -(h + copysignf(sqrtf(discriminant), h));
+  float t0 = q / a;
+  float t1 = c / q;
+  //Written as the min/max instructions behave, NaNs included
+  float near = t0 < t1 ? t0 : t1;
+  float far = t0 > t1 ? t0 : t1;
+  float t = near >= 0 ? near : far;
+  return t >= 0 ? t : -1;
+}
+
+#if SPHERE_AVX2
+// The same as SphereDistance for the eight spheres from slot, returns a bit per sphere that is hit
+__attribute__((target("avx2")))
+inline unsigned int SphereBlockAVX2(const float* x, const float* y, const float* z, const float* radius2,
+                                    const vec3& origin, const vec3& direction, float a, float* distances) {
+  __m256 lx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(x));
+  __m256 ly = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(y));
+  __m256 lz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(z));
+  __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(direction.x), lx),
+                                         _mm256_mul_ps(_mm256_set1_ps(direction.y), ly)),
+                           _mm256_mul_ps(_mm256_set1_ps(direction.z), lz));
+  __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz)),
+                           _mm256_loadu_ps(radius2));
+  __m256 va = _mm256_set1_ps(a);
+  __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(va, c));
+  __m256 zero = _mm256_setzero_ps();
+  __m256 hit = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+  if(_mm256_movemask_ps(hit) == 0) return 0;
+
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 root = _mm256_or_ps(_mm256_sqrt_ps(discriminant), _mm256_and_ps(h, sign));
+  __m256 q = _mm256_xor_ps(_mm256_add_ps(h, root), sign);
+  __m256 t0 = _mm256_div_ps(q, va);
+  __m256 t1 = _mm256_div_ps(c, q);
+  __m256 near = _mm256_min_ps(t0, t1);
+  __m256 far = _mm256_max_ps(t0, t1);
+  __m256 t = _mm256_blendv_ps(far, near, _mm256_cmp_ps(near, zero, _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+  _mm256_storeu_ps(distances, t);
+  return _mm256_movemask_ps(hit);
+}
+
+inline bool HasAVX2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+#endif
+
+class SpherePack {
+public:
+  std::vector<float> x, y, z, radius2;
+  std::vector<uint32_t> ids;    // scene sphere in each slot
+
+  // Lays the spheres out in the order of bvh, which has to be built over them. Spheres is anything indexable
+  // whose elements have origin and radius2, so a scene's spheres or a copy being animated.
+  template <typename Spheres>
+  void update(const Spheres& spheres, const BVH& bvh) {
+    size_t count = bvh.primitives.size();
+    size_t padded = count + SPHERE_LANES;
+    x.assign(padded, 0);
+    y.assign(padded, 0);
+    z.assign(padded, 0);
+    radius2.assign(padded, -INFINITY);
+    ids.assign(padded, UINT32_MAX);
+    #pragma omp parallel for
+    for(size_t slot = 0; slot < count; slot++) {
+      uint32_t id = bvh.primitives[slot];
+      x[slot] = spheres[id].origin.x;
+      y[slot] = spheres[id].origin.y;
+      z[slot] = spheres[id].origin.z;
+      radius2[slot] = spheres[id].radius2;
+      ids[slot] = id;
+    }
+  }
+
+  // Nearest sphere in slots [first, first + count) that is closer than closest (no limit while it is negative),
+  // equal distances go to the lower sphere index when sphere is the one they tie with. Lowers closest and sets
+  // sphere when one is found.
+  void closestIn(const vec3& origin, const vec3& direction, uint32_t first, uint32_t count, float& closest, long int& sphere) const {
+    float a = glm::dot(direction, direction);
+    float distances[SPHERE_LANES];
+    for(uint32_t block = first; block < first + count; block += SPHERE_LANES) {
+      unsigned int hits = test(origin, direction, a, block, distances);
+      hits &= (1u << std::min<uint32_t>(SPHERE_LANES, first + count - block)) - 1;
+      for(int lane = 0; hits; lane++, hits >>= 1) {
+        if(!(hits & 1)) continue;
+        float t = distances[lane];
+        long int id = ids[block + lane];
+        if(closest < 0 || t < closest || (t == closest && sphere >= 0 && id < sphere)) {
+          closest = t;
+          sphere = id;
+        }
+      }
+    }
+  }
+
+  bool anyIn(const vec3& origin, const vec3& direction, uint32_t first, uint32_t count) const {
+    float a = glm::dot(direction, direction);
+    float distances[SPHERE_LANES];
+    for(uint32_t block = first; block < first + count; block += SPHERE_LANES) {
+      unsigned int hits = test(origin, direction, a, block, distances);
+      if(hits & ((1u << std::min<uint32_t>(SPHERE_LANES, first + count - block)) - 1)) return true;
+    }
+    return false;
+  }
+
+private:
+  unsigned int test(const vec3& origin, const vec3& direction, float a, uint32_t block, float* distances) const {
+#if SPHERE_AVX2
+    if(HasAVX2()) {
+      return SphereBlockAVX2(&x[block], &y[block], &z[block], &radius2[block], origin, direction, a, distances);
+    }
+#endif
+    unsigned int hits = 0;
+    for(int lane = 0; lane < SPHERE_LANES; lane++) {
+      distances[lane] = SphereDistance(origin, direction, a, x[block + lane], y[block + lane], z[block + lane], radius2[block + lane]);
+      if(distances[lane] >= 0) hits |= 1u << lane;
+    }
+    return hits;
+  }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Building with RENDER_STATS=0 compiles the counters out
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+
+// Counts of the work done for a frame, for tracking rays per second across builds. Every thread counts into
+// a block of its own, so counting is an unshared increment, and the blocks are summed between frames when
+// nothing is tracing. Traversals add their node visits and primitive tests once at the end rather than per node.
+
+enum StatCounter {
+  STAT_PRIMARY_RAYS,
+  STAT_SHADOW_RAYS,
+  STAT_REFLECTION_RAYS,
+  STAT_REFRACTION_RAYS,
+  STAT_INDIRECT_RAYS,
+  STAT_PHOTON_RAYS,
+  STAT_PRIMITIVE_TESTS,   // faces, triangles, spheres and instances a ray was tested against
+  STAT_NODE_VISITS,       // BVH nodes taken off the stack
+  STAT_PHOTON_RESULTS,    // photons found by caustic lookups
+  STAT_COUNT
+};
+
+const char* const STAT_NAMES[STAT_COUNT] = {
+  "primary_rays", "shadow_rays", "reflection_rays", "refraction_rays", "indirect_rays", "photon_rays",
+  "primitive_tests", "node_visits", "photon_results"
+};
+
+// A cache line or more each, so threads never write to the same line
+struct ThreadStats {
+  uint64_t counts[STAT_COUNT];
+  char padding[64 - ((STAT_COUNT * sizeof(uint64_t)) % 64)];
+};
+
+std::mutex stats_mutex;
+std::vector<ThreadStats*> stats_blocks;   // kept after their thread ends, so nothing it counted is lost
+thread_local ThreadStats* thread_stats = NULL;
+
+ThreadStats* RegisterThreadStats() {
+  void* memory = NULL;
+  if(posix_memalign(&memory, 64, sizeof(ThreadStats)) != 0) abort();
+  memset(memory, 0, sizeof(ThreadStats));
+  thread_stats = (ThreadStats*)memory;
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  stats_blocks.push_back(thread_stats);
+  return thread_stats;
+}
+
+inline void CountStat(StatCounter counter, uint64_t amount = 1) {
+#if RENDER_STATS
+  ThreadStats* stats = thread_stats;
+  if(!stats) stats = RegisterThreadStats();
+  stats->counts[counter] += amount;
+#endif
+}
+
+// Sums every thread's counts into counts and starts them again from zero. Only call it while no rays are
+// being traced.
+void TakeStats(uint64_t counts[STAT_COUNT]) {
+  memset(counts, 0, STAT_COUNT * sizeof(uint64_t));
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  for(size_t i = 0; i < stats_blocks.size(); i++) {
+    for(int c = 0; c < STAT_COUNT; c++) counts[c] += stats_blocks[i]->counts[c];
+    memset(stats_blocks[i]->counts, 0, sizeof(stats_blocks[i]->counts));
+  }
+}
+
+uint64_t TracedRays(const uint64_t counts[STAT_COUNT]) {
+  uint64_t rays = 0;
+  for(int c = STAT_PRIMARY_RAYS; c <= STAT_PHOTON_RAYS; c++) rays += counts[c];
+  return rays;
+}
+
+// One frame's worth of the summary. Rows encoded while the rest of the image renders count as render
+// time, encode_seconds is what is left once rendering has finished.
+struct FrameStats {
+  int frame;
+  int width;
+  int height;
+  int spp;
+  int threads;
+  double photon_seconds;
+  double render_seconds;
+  double encode_seconds;
+  uint64_t counts[STAT_COUNT];
+};
+
+FILE* stats_file = NULL;
+
+// "-" writes the summary to stdout. The summary keeps stdout to itself then, everything else printed goes to
+// stderr instead, so the output can be piped straight into something reading JSON lines.
+bool OpenStats(const std::string& path) {
+  if(path == "-") {
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    stats_file = fd < 0 ? NULL : fdopen(fd, "w");
+    if(stats_file) dup2(STDERR_FILENO, STDOUT_FILENO);
+  } else {
+    stats_file = fopen(path.c_str(), "w");
+  }
+  if(!stats_file) printf("Failed to open %s\n", path.c_str());
+  return stats_file != NULL;
+}
+
+// One JSON object per line. rays_per_second leaves photons out, they are traced before rendering starts.
+void WriteStats(const FrameStats& stats) {
+  if(!stats_file) return;
+  uint64_t rays = TracedRays(stats.counts) - stats.counts[STAT_PHOTON_RAYS];
+  fprintf(stats_file, "{\"frame\": %d, \"width\": %d, \"height\": %d, \"spp\": %d, \"threads\": %d, ",
+    stats.frame, stats.width, stats.height, stats.spp, stats.threads);
+  fprintf(stats_file, "\"photon_seconds\": %.6f, \"render_seconds\": %.6f, \"encode_seconds\": %.6f",
+    stats.photon_seconds, stats.render_seconds, stats.encode_seconds);
+  for(int c = 0; c < STAT_COUNT; c++) fprintf(stats_file, ", \"%s\": %llu", STAT_NAMES[c], (unsigned long long)stats.counts[c]);
+  fprintf(stats_file, ", \"rays_per_second\": %.0f}\n", stats.render_seconds > 0 ? rays / stats.render_seconds : 0.0);
+  fflush(stats_file);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef TILESTREAM_H
+#define TILESTREAM_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdio.h>
+#include <sys/types.h>
+#include "hdr.h"
+
+// Writes finished tiles of a .tfl file from a background thread. Tiles may arrive in any order since every
+// tile has a fixed slot in the file. At most capacity tiles wait in memory, push() blocks past that, so
+// memory use depends on the tile size and the number of producers rather than on the image size.
+class TileWriter {
+public:
+  TileWriter()
+    : file(NULL), tile_bytes(0), capacity(0), finished(false), failed(false)
+  {
+
+  }
+
+  ~TileWriter() {
+    close();
+  }
+
+  bool open(const std::string& path, int width, int height, int tile_size, size_t max_pending) {
+    file = fopen(path.c_str(), "wb");
+    if(!file) return false;
+
+    TiledFloatHeader header = MakeTiledFloatHeader(width, height, tile_size);
+    fwrite(&header, sizeof(header), 1, file);
+
+    tile_bytes = TiledFloatTileBytes(tile_size);
+    capacity = std::max(max_pending, (size_t)1);
+    finished = false;
+    failed = ferror(file) != 0;
+    writer = std::thread(&TileWriter::run, this);
+    return !failed;
+  }
+
+  // Takes the contents of tile, leaving it empty for the caller to refill
+  void push(int index, std::vector<float>& tile) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]() { return queue.size() < capacity; });
+    queue.push_back(PendingTile());
+    queue.back().index = index;
+    queue.back().data.swap(tile);
+    not_empty.notify_one();
+  }
+
+  // Waits for every queued tile to reach the file, false if anything failed along the way
+  bool close() {
+    if(!file) return false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+    }
+    not_empty.notify_one();
+    writer.join();
+
+    bool ok = !failed && !ferror(file);
+    ok = (fclose(file) == 0) && ok;
+    file = NULL;
+    return ok;
+  }
+
+private:
+  struct PendingTile {
+    int index;
+    std::vector<float> data;
+  };
+
+  FILE* file;
+  size_t tile_bytes;
+  size_t capacity;
+  bool finished;
+  bool failed;
+
+  std::deque<PendingTile> queue;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::thread writer;
+
+  void run() {
+    while(true) {
+      PendingTile tile;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return finished || !queue.empty(); });
+        if(queue.empty()) return;
+        tile.index = queue.front().index;
+        tile.data.swap(queue.front().data);
+        queue.pop_front();
+      }
+      not_full.notify_one();
+
+      //Offsets pass 2 GB quickly on poster sized images, so seek with off_t
+      off_t offset = (off_t)sizeof(TiledFloatHeader) + ((off_t)tile.index * (off_t)tile_bytes);
+      if(fseeko(file, offset, SEEK_SET) != 0 || fwrite(tile.data.data(), 1, tile_bytes, file) != tile_bytes) {
+        failed = true;
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+// Lock-free single producer / single consumer triple buffer. The producer always owns a slot to write
+// into and the consumer always owns the newest complete one, so neither side ever waits on the other.
+template <typename T>
+class TripleBuffer {
+public:
+  TripleBuffer(size_t size = 0)
+    : back_index(0), front_index(1), middle(2)
+  {
+    resize(size);
+  }
+
+  void resize(size_t size) {
+    for(int i = 0; i < 3; i++) slots[i].assign(size, T());
+  }
+
+  T* back() {
+    return slots[back_index].data();
+  }
+
+  const T* front() const {
+    return slots[front_index].data();
+  }
+
+  // Producer: hand the finished back slot over and take the stale middle one
+  void publish() {
+    back_index = middle.exchange(back_index | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Consumer: swap in the newest frame, returns false if nothing new was published
+  bool consume() {
+    if(!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+    front_index = middle.exchange(front_index, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+private:
+  static const int INDEX = 3;
+  static const int FRESH = 4;
+
+  std::vector<T> slots[3];
+  int back_index;
+  int front_index;
+  std::atomic<int> middle;
+};
+
+#endif